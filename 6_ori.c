@@ -4,6 +4,7 @@ the network layer always has an infinite supply of packets to send.
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include "protocol.h"
@@ -21,20 +22,26 @@ bool DEBUG = false;
 //typedef enum { frame_arrival, cksum_err, timeout, network_layer_ready, ack_timeout }event_type;
 
 typedef enum { data = 1, ack = 2, nak = 3 } frame_kind;
-typedef struct { unsigned char data[PKT_LEN]; } packet;
 
+// 包长运行时才知道（最长pkt_len_max()，可达64KB），帧缓冲区都在堆上。
+// 窗口的每个槽位是一整帧：包直接取到帧里，收到的帧交换指针放进窗口，都不拷贝
 typedef struct FRAME
 {
 	unsigned char kind; /* FRAME_DATA */
 	unsigned char ack;
 	unsigned char seq;
-	packet data;
-	unsigned int  padding;//padding字段用来存放crc校验位
+	unsigned char data[1];	// 包，crc由物理层加在帧后
 }frame;
 
-bool no_nak = true;			// no nak has been sent yet
+#define FRAME_HDR 3			// kind, ack, seq
+
+// 每个链路实例各自一份，放在main的栈上（fleet模式下一个进程内有多个实例）
+typedef struct
+{
+	bool no_nak;			// no nak has been sent yet
+	int phl_ready;
+}link_state;
 //int oldest_fream = MAX_SEQ + 1;// initial value is only for the simulator****
-int phl_ready = 0;
 
 static bool between(seq_nr a, seq_nr b, seq_nr c)
 {
@@ -42,43 +49,45 @@ static bool between(seq_nr a, seq_nr b, seq_nr c)
 	return ((a <= b) && (b < c)) || ((c < a) && (a <= b)) || ((b < c) && (c < a));
 }
 
-static void put_frame(unsigned char *frame, int len)
+static void put_frame(link_state *ls, unsigned char *frame, int len, bool resend)
 {
-	*(unsigned int *)(frame + len) = crc32(frame, len);//将crc函数计算得到的结果（4字节int）存放在padding字段
-	send_frame(frame, len + 4);
-	phl_ready = 0;
+	// crc由物理层在编码时算出，紧跟在帧后发送；重传帧另行告知物理层
+	if ((resend ? resend_frame_crc(frame, len) : send_frame_crc(frame, len)) == PHL_DROPPED)
+		dbg_warning("Physical layer sending queue is full, frame dropped\n");//由超时重传恢复
+	ls->phl_ready = 0;
 }
 
-static void Send_Frame(frame_kind fk, seq_nr frame_nr, seq_nr frame_expected, packet buffer[])
+static void Send_Frame(link_state *ls, frame_kind fk, seq_nr frame_nr, seq_nr frame_expected, frame *buffer[], int buf_len[], bool resend)
 {
 	// construct and send a data, ack or nak frame
-	frame s;					// scratch variable
+	unsigned char ctl[8];		// ack/nak只有帧头
+	frame *s = fk == FRAME_DATA ? buffer[frame_nr % NR_BUFS] : (frame *)ctl;	// 数据帧就在窗口槽位里组帧
 
-	s.kind = fk;				// kind == data, ack, nak
+	s->kind = fk;				// kind == data, ack, nak
 	if (fk == FRAME_DATA)
 	{
-		s.data = buffer[frame_nr % NR_BUFS];
-		s.seq = frame_nr;		// only meaningful for data frames
-		s.ack = (seq_nr)((frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
-		dbg_frame("Send DATA %d %d, ID %d\n", s.seq, s.ack, *(short*)(s.data.data));
-		put_frame((unsigned char*)& s, 3 + PKT_LEN);
+		s->seq = frame_nr;		// only meaningful for data frames
+		s->ack = (seq_nr)((frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
+		dbg_frame("Send DATA %d %d, ID %d\n", s->seq, s->ack, *(short*)(s->data));
+		put_frame(ls, (unsigned char*)s, FRAME_HDR + buf_len[frame_nr % NR_BUFS], resend);
 		start_timer(frame_nr/* % NR_BUFS*/, DATA_TIMER);
 	}
 	if (fk == FRAME_NAK)			// one nak per frame
 	{
-		s.seq = frame_nr;		// only meaningful for data frames
-		s.ack = (seq_nr)((frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
-		no_nak = false;
-		dbg_frame("Send NAK  %d\n", s.ack);
-		put_frame((unsigned char*)& s, 2);
+		s->seq = frame_nr;		// only meaningful for data frames
+		s->ack = (seq_nr)((frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
+		ls->no_nak = false;
+		dbg_frame("Send NAK  %d\n", s->ack);
+		dbg_count(COUNT_NAK);
+		put_frame(ls, (unsigned char*)s, 2, false);
 	}
 	// to_physcial_layer(&s);		// transmit the frame
 	if (fk == FRAME_ACK)
 	{
-		s.seq = frame_nr;		// only meaningful for data frames
-		s.ack = (seq_nr)((frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
-		dbg_frame("Send ACK  %d\n", s.ack);
-		put_frame((unsigned char*)& s, 2);
+		s->seq = frame_nr;		// only meaningful for data frames
+		s->ack = (seq_nr)((frame_expected + MAX_SEQ) % (MAX_SEQ + 1));
+		dbg_frame("Send ACK  %d\n", s->ack);
+		put_frame(ls, (unsigned char*)s, 2, false);
 	}
 
 	stop_ack_timer();			// no need for separate ack frame
@@ -92,9 +101,11 @@ int main(int argc, char **argv)
 	seq_nr frame_expected;				// (R)lower edge of reciever's window
 	seq_nr too_far;						// (R)upper edge of reciever's window + 1
 	int i;								// index into buffer pool
-	struct FRAME f;							// scratch variable
-	packet out_buf[NR_BUFS];			// (S)buffer for the outbound stream
-	packet in_buf[NR_BUFS];				// (R)buffer for the inbound stream
+	frame *f, *spare;					// 收到的帧, 接收下一帧的空闲缓冲区
+	frame *out_buf[NR_BUFS];			// (S)buffer for the outbound stream
+	frame *in_buf[NR_BUFS];				// (R)buffer for the inbound stream
+	int frame_size;						// 帧缓冲区大小
+	int out_len[NR_BUFS], in_len[NR_BUFS];	// 包长度可变，随缓冲区保存
 	// Associated with each buffer is a bit (arrived) telling whether the buffer is full or empty
 	bool arrived[NR_BUFS];			// (R)inbound bit map
 	seq_nr nbuffered;					// (S)how many output buffers currently used
@@ -110,10 +121,26 @@ int main(int argc, char **argv)
 
 	int event, arg;
 	int len = 0;
+	link_state ls = { true, 0 };
 
 	protocol_init(argc, argv);
 	lprintf("Designed by 223, build: " __DATE__"  "__TIME__"\n");
 
+	frame_size = pkt_len_max() + FRAME_SLACK;
+	f = spare = (frame *)malloc(frame_size);
+	for (i = 0; i < NR_BUFS; i++)
+	{
+		out_buf[i] = (frame *)malloc(frame_size);
+		in_buf[i] = (frame *)malloc(frame_size);
+		if (out_buf[i] == NULL || in_buf[i] == NULL)
+			f = NULL;
+	}
+	if (f == NULL)
+	{
+		lprintf("No enough memory for %d-byte frames\n", frame_size);
+		exit(0);
+	}
+
 	while (true)
 	{
 		event = wait_for_event(&arg);	// 5 possibilities: frame_arrival, cksum_err, timeout, network_layer_ready, ack_timeout
@@ -132,34 +159,49 @@ int main(int argc, char **argv)
 				printf("\n*******************************************\n");
 			}*/
 
-			nbuffered = nbuffered + 1;	// expand the window
-			get_packet(out_buf[next_frame_to_send % NR_BUFS].data);
-			Send_Frame(data, next_frame_to_send, frame_expected, out_buf);
-			inc(next_frame_to_send);
+			// arg为可一次取走的包数，一次填满空闲窗口
+			{
+				unsigned char *bufs[NR_BUFS];
+				int lens[NR_BUFS], n;
+
+				n = NR_BUFS - nbuffered < arg ? NR_BUFS - nbuffered : arg;
+				for (i = 0; i < n; i++)
+					bufs[i] = out_buf[(next_frame_to_send + i) % NR_BUFS]->data;
+				n = get_packets(bufs, lens, n);
+				for (i = 0; i < n; i++)
+				{
+					nbuffered = nbuffered + 1;	// expand the window
+					out_len[next_frame_to_send % NR_BUFS] = lens[i];
+					Send_Frame(&ls, data, next_frame_to_send, frame_expected, out_buf, out_len, false);
+					inc(next_frame_to_send);
+				}
+			}
 			break;
 
 		case PHYSICAL_LAYER_READY:
-			phl_ready = 1;
+			ls.phl_ready = 1;
 			break;
 
 		case FRAME_RECEIVED:			// (R)a data or control frame has arrived
-			len = recv_frame((unsigned char *)&f, sizeof(f));
+			f = spare;
+			len = recv_frame_crc((unsigned char *)f, frame_size);
 			//from_physical_layer(&r);// (R)fetch incoming frame from physical layer
-			if (len < 5 || crc32((unsigned char *)&f, len) != 0) 
-				//计算整个帧的crc，含padding字段，故crc校验结果理应为0
+			if (len < 1) 
+				//物理层解码时已校验crc，坏帧返回-1，返回的长度不含crc
 			{
 				dbg_event("**** Receiver Error, Bad CRC Checksum\n");
-				if (no_nak)
-					Send_Frame(nak, 0, frame_expected, out_buf);
+				dbg_count(COUNT_BAD_CRC);
+				if (ls.no_nak)
+					Send_Frame(&ls, nak, 0, frame_expected, out_buf, out_len, false);
 				break;
 			}
 					
-			if (f.kind == FRAME_ACK)
-				dbg_frame("Recv ACK  %d\n", f.ack);
-			if (f.kind==FRAME_NAK)
-				dbg_frame("Recv NAK  %d\n", f.ack);
+			if (f->kind == FRAME_ACK)
+				dbg_frame("Recv ACK  %d\n", f->ack);
+			if (f->kind==FRAME_NAK)
+				dbg_frame("Recv NAK  %d\n", f->ack);
 
-			if (f.kind == FRAME_DATA)
+			if (f->kind == FRAME_DATA)
 			{
 				/*if (DEBUG)
 				{
@@ -171,11 +213,11 @@ int main(int argc, char **argv)
 					printf("\n*******************************************\n");
 				}*/
 
-				dbg_frame("Recv DATA %d %d, ID %d\n", f.seq, f.ack, *(short *)(f.data.data));
+				dbg_frame("Recv DATA %d %d, ID %d\n", f->seq, f->ack, *(short *)(f->data));
 				// (R)an undamaged frame has arrived
-				if (f.seq != frame_expected && no_nak)
+				if (f->seq != frame_expected && ls.no_nak)
 				// (R)frame out of sequence
-					Send_Frame(nak, 0, frame_expected, out_buf);	// sen nak to stimulate retransmission
+					Send_Frame(&ls, nak, 0, frame_expected, out_buf, out_len, false);	// sen nak to stimulate retransmission
 					/*
 					NAKs IMPROVE PERFORMANCE:
 					If the NAK get lost, eventually the sender will time out for the very frame
@@ -184,30 +226,37 @@ int main(int argc, char **argv)
 				else
 					start_ack_timer(ACK_TIMER);
 
-				if (between(frame_expected, f.seq, too_far) && (arrived[f.seq % NR_BUFS] == false))
+				if (between(frame_expected, f->seq, too_far) && (arrived[f->seq % NR_BUFS] == false))
 				{
 					// frames may be accepeted in any order
-					arrived[f.seq % NR_BUFS] = true;		// mark buffer as full
-					in_buf[f.seq % NR_BUFS] = f.data;		// insert data into buffer
+					arrived[f->seq % NR_BUFS] = true;		// mark buffer as full
+					spare = in_buf[f->seq % NR_BUFS];		// insert data into buffer, 交换指针，f仍指向该帧
+					in_buf[f->seq % NR_BUFS] = f;
+					in_len[f->seq % NR_BUFS] = len - FRAME_HDR;
 					
+					unsigned char *bufs[NR_BUFS];
+					int lens[NR_BUFS], n = 0;
+
 					while (arrived[frame_expected % NR_BUFS] == true)
 					{
 						// pass frames and advance window
 						//to_network_layer(&in_buf[frame_expected % NR_BUFS]);
-						put_packet(in_buf[frame_expected % NR_BUFS].data, len - 7);
-						no_nak = true;
+						bufs[n] = in_buf[frame_expected % NR_BUFS]->data;	// 连续的包攒齐后一次交付
+						lens[n++] = in_len[frame_expected % NR_BUFS];
+						ls.no_nak = true;
 						arrived[frame_expected % NR_BUFS] = false;
 						inc(frame_expected);			// advance lower edge of reciever's window
 						inc(too_far);					// advance upper edge of reciever's window
 						start_ack_timer(ACK_TIMER);				// to see if separate ack is needed
 					}
+					put_packets(bufs, lens, n);
 				}
 			}
 
-			if ((f.kind == FRAME_NAK) && between(ack_expected, (f.ack + 1) % (MAX_SEQ + 1), next_frame_to_send))
-				Send_Frame(data, (f.ack + 1) % (MAX_SEQ + 1), frame_expected, out_buf);
+			if ((f->kind == FRAME_NAK) && between(ack_expected, (f->ack + 1) % (MAX_SEQ + 1), next_frame_to_send))
+				Send_Frame(&ls, data, (f->ack + 1) % (MAX_SEQ + 1), frame_expected, out_buf, out_len, true);
 
-			while (between(ack_expected, f.ack, next_frame_to_send))
+			while (between(ack_expected, f->ack, next_frame_to_send))
 			{
 				nbuffered = nbuffered - 1;				// handle piggybacked ack
 				stop_timer(ack_expected/* % NR_BUFS*/);		// frame arrived intact
@@ -227,8 +276,8 @@ int main(int argc, char **argv)
 			break;
 
 		//case cksum_err:
-		//	if (no_nak)
-		//		Send_Frame(nak, 0, frame_expected, out_buf);	// damaged frame
+		//	if (ls.no_nak)
+		//		Send_Frame(&ls, nak, 0, frame_expected, out_buf, out_len, false);	// damaged frame
 		//	break;
 
 		case DATA_TIMEOUT:
@@ -243,7 +292,7 @@ int main(int argc, char **argv)
 			}*/
 
 			dbg_event("---- DATA %d timeout\n", arg);
-			Send_Frame(data, arg, frame_expected, out_buf); // timed out
+			Send_Frame(&ls, data, arg, frame_expected, out_buf, out_len, true); // timed out
 			break;
 
 		case ACK_TIMEOUT:
@@ -257,11 +306,11 @@ int main(int argc, char **argv)
 				printf("\n*******************************************\n");
 			}*/
 
-			Send_Frame(ack, 0, frame_expected, out_buf);		// ack timer expired; send ack
+			Send_Frame(&ls, ack, 0, frame_expected, out_buf, out_len, false);		// ack timer expired; send ack
 			break;
 		}
 
-		if (nbuffered < NR_BUFS && phl_ready)
+		if (nbuffered < NR_BUFS && ls.phl_ready)
 			enable_network_layer();
 		else
 			disable_network_layer();
@@ -0,0 +1,556 @@
+/*
+    chanemu: channel emulator between station A and station B
+
+    Both stations are started with option --chanemu and connect to chanemu
+    instead of each other. Their physical layers then pass the bytes through,
+    and chanemu imposes rate, propagation delay and bit errors of both
+    directions in its own process, optionally pinned on its own CPU core.
+*/
+
+#ifndef	_CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#include <time.h>
+
+static time_t epoch; /* epoch timestamp (be same for Station A & B) */
+
+#ifdef _WIN32 /* for Windows Visual Studio */
+
+#include <winsock.h>
+#include <io.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/timeb.h>
+#include "getopt.h"
+
+#define getopt_long getopt_int
+#define sock_again() (WSAGetLastError() == WSAEWOULDBLOCK)
+#define sock_nonblock(s) do { u_long on = 1; ioctlsocket(s, FIONBIO, &on); } while (0)
+
+static void socket_init(void)
+{
+    WORD wVersionRequested;
+    WSADATA WSAData;
+	int status;
+
+    wVersionRequested = MAKEWORD(1,1);
+    status = WSAStartup(wVersionRequested, &WSAData);
+    if (status != 0) {
+        printf("Windows Socket DLL Error\n");
+	    exit(0);
+    }
+}
+
+unsigned int get_ms(void)
+{
+	struct _timeb tm;
+
+	_ftime(&tm);
+
+	return (unsigned int)(epoch ? (tm.time - epoch) * 1000 + tm.millitm : 0);
+}
+
+static int pin_cpu(int cpu)
+{
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0;
+}
+
+#pragma comment(lib,"wsock32.lib")
+
+#else /* for Linux */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <signal.h>
+#define sock_again() (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#define sock_nonblock(s) fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK)
+#define socket_init() signal(SIGPIPE, SIG_IGN) /* a broken link is reported by send() */
+
+unsigned int get_ms(void)
+{
+	struct timeval tm;
+	struct timezone tz;
+
+	gettimeofday(&tm, &tz);
+
+	return (unsigned int)(epoch ? (tm.tv_sec - epoch) * 1000 + tm.tv_usec / 1000 : 0);
+}
+
+static int pin_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "lprintf.h"
+#include "channel.h"
+
+#define VERSION "1.0"
+
+#define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+
+#define EMU_TICK  1      /* ms */
+#define RECV_SIZE 4096   /* bytes read from a station at a time */
+#define QUEUE_MAX (256 * 1024) /* bytes of a direction held, then the station waits */
+#define STAT_INTERVAL 10000 /* ms */
+
+/* Parameters */
+static struct CHANNEL chan[2] = {
+    { DEFAULT_CHAN_BPS, DEFAULT_CHAN_DELAY, DEFAULT_CHAN_BER },
+    { DEFAULT_CHAN_BPS, DEFAULT_CHAN_DELAY, DEFAULT_CHAN_BER },
+};
+static struct PHASE *phases;
+static int nphase = 0, cur_phase = -1;
+static char *schedule_file = NULL;
+static int mode_life = 0x7fffff00;
+static int mode_seed = 0x098bcde1;
+static unsigned int noise_seed;    /* of chan_rand(), from mode_seed */
+static int mode_cpu = -1;
+static int debug_mask = 0;
+static unsigned short port = DEFAULT_PORT;
+
+static int now; /* timestamp (ms) */
+
+struct BLK {
+    int commit_ts;
+    int rptr, wptr;
+    struct BLK *link;
+    unsigned char data[1];
+};
+
+/* one direction of the channel */
+struct LINK {
+    char *name;
+    int src, dst;                       /* sockets of sending/receiving station */
+    struct CHANNEL *chan;
+    struct BLK *in_head, *in_tail;      /* sent by the station, waiting for the channel */
+    struct BLK *fly_head, *fly_tail;    /* on the channel, due at commit_ts */
+    int queued;                         /* bytes in the in-queue */
+    int flying;                         /* bytes on the channel, or not yet taken by the station */
+    int last_ts, allowed_frac;          /* rate limiter (1/1000 byte) */
+    unsigned int bytes, nbits;
+    int noise;
+};
+
+static struct LINK links[2];
+
+static struct option intopts[] = {
+	{ "help",	no_argument, NULL, '?' },
+	{ "utopia", no_argument, NULL, 'u' },
+	{ "nolog",  no_argument, NULL, 'n' },
+	{ "debug",	required_argument, NULL, 'd' },
+	{ "port",	required_argument, NULL, 'p' },
+	{ "log",	required_argument, NULL, 'l' },
+	{ "ttl",    required_argument, NULL, 't' },
+	{ "cpu",    required_argument, NULL, 'c' },
+	CHANNEL_LONG_OPTIONS,
+	{ 0, 0, 0, 0 },
+};
+
+#define OPT_SHORT "?und:p:b:l:t:c:"
+
+static void config(int argc, char **argv)
+{
+	char fname[1024];
+	int  opt;
+
+	strcpy(fname, "chanemu.log");
+
+	while ((opt = getopt_long(argc, argv, OPT_SHORT, intopts, NULL)) != -1) {
+		switch (opt) {
+		case '?':
+		usage:
+			printf("\nUsage:\n  %s <options>\n", argv[0]);
+			printf(
+				"\nOptions : \n"
+				"    -?, --help : print this\n"
+				"    -n, --nolog : do not create log file\n"
+				"    -d, --debug=<0-7>: debug mask (bit2:warning)\n"
+				"    -p, --port=<port#> : TCP port number (default: %u)\n"
+				"    -l, --log=<filename> : using assigned file as log file\n"
+				"    -t, --ttl=<seconds> : set time-to-live\n"
+				"    -c, --cpu=<cpu#> : run on the assigned CPU core\n"
+				CHANNEL_USAGE
+				"\n"
+				"i.e.\n"
+				"    %s --cpu=3 --bps-ab=64000 --bps-ba=4000 -b 1e-5\n"
+				"    datalink --chanemu -f A\n"
+				"    datalink --chanemu -f B\n"
+				"\n",
+				DEFAULT_PORT, argv[0]);
+			exit(0);
+
+		case 'n':
+			strcpy(fname, "nul");
+			break;
+
+		case 'd':
+			debug_mask = atoi(optarg);
+			break;
+
+		case 'p':
+			port = (unsigned short)atoi(optarg);
+			break;
+
+		case 'l':
+			strcpy(fname, optarg);
+			break;
+
+		case 't':
+			mode_life = atoi(optarg) * 1000; /* ms */
+			break;
+
+		case 'c':
+			mode_cpu = atoi(optarg);
+			break;
+
+		case OPT_SCHEDULE:
+			schedule_file = optarg;
+			break;
+
+		default:
+			if (channel_option(opt, optarg, chan))
+				break;
+			printf("ERROR: Unsupported option\n");
+			goto usage;
+		}
+	}
+
+	if (strcmp(fname, "nul") == 0)
+		log_file = NULL;
+	else if ((log_file = fopen(fname, "w")) == NULL)
+		printf("WARNING: Failed to create log file \"%s\": %s\n", fname, strerror(errno));
+
+	lprintf(
+		"=============================================================\n"
+		"                    Channel Emulator                         \n"
+		"-------------------------------------------------------------\n");
+
+	lprintf("chanemu, version %s\n", VERSION);
+	lprintf("Log file \"%s\", TCP port %d, debug mask 0x%02x\n", fname, port, debug_mask);
+	print_channel("A->B", &chan[CHAN_AB]);
+	print_channel("B->A", &chan[CHAN_BA]);
+
+	if (schedule_file) {
+		nphase = load_schedule(schedule_file, chan, &phases);
+		lprintf("Channel schedule \"%s\", %d phases, last one begins at %d.%03d s\n", schedule_file,
+			nphase, phases[nphase - 1].start / 1000, phases[nphase - 1].start % 1000);
+	}
+
+	if (mode_cpu >= 0) {
+		if (pin_cpu(mode_cpu))
+			lprintf("Running on CPU %d\n", mode_cpu);
+		else
+			lprintf("WARNING: Failed to run on CPU %d\n", mode_cpu);
+	}
+}
+
+static void hs_send(int sock, void *buf, int len)
+{
+    int n;
+
+    for (; len > 0; len -= n, buf = (char *)buf + n) {
+        n = send(sock, (char *)buf, len, 0);
+        if (n <= 0)
+            ABORT("Link setup handshake failed (send)");
+    }
+}
+
+/* Accept both stations, then dictate epoch and channel parameters */
+static void accept_stations(void)
+{
+    int admin_sock, sock, i, sa = -1, sb = -1, on = 1;
+    struct sockaddr_in name;
+    char station;
+
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = INADDR_ANY;
+    name.sin_port = htons(port);
+
+    admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (admin_sock < 0)
+        ABORT("Create TCP socket");
+    /* rebind at once when runs are started back to back */
+    setsockopt(admin_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+    if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+        lprintf("chanemu: Failed to bind TCP port %u", port);
+        ABORT("chanemu failed to bind TCP port");
+    }
+
+    listen(admin_sock, 5);
+
+    while (sa < 0 || sb < 0) {
+        lprintf("chanemu is waiting for station %s on TCP port %u ... ", sa < 0 && sb < 0 ? "A and B" : sa < 0 ? "A" : "B", port);
+        fflush(stdout);
+
+        sock = accept(admin_sock, 0, 0);
+        if (sock < 0 || recv(sock, &station, 1, 0) != 1)
+            ABORT("chanemu failed to communicate with station");
+
+        if (station == 'a' && sa < 0)
+            sa = sock;
+        else if (station == 'b' && sb < 0)
+            sb = sock;
+        else
+            ABORT("Unexpected station");
+        lprintf("Station %c.\n", station - 'a' + 'A');
+    }
+
+    time(&epoch);
+
+    for (i = 0; i < 2; i++) {
+        int on = 1, buf_size = 1024 * 64;
+
+        sock = i == 0 ? sa : sb;
+        hs_send(sock, &epoch, sizeof(epoch));
+        hs_send(sock, chan, sizeof(chan));
+        hs_send(sock, &nphase, sizeof(nphase));
+        if (nphase)
+            hs_send(sock, phases, nphase * sizeof(struct PHASE));
+
+        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+
+        /* a stalled station must not hold up the other direction */
+        sock_nonblock(sock);
+    }
+
+    {
+        struct tm *newtime;
+        newtime = localtime(&epoch);
+        lprintf("New epoch: %s", asctime(newtime));
+        lprintf("=================================================================\n\n");
+    }
+
+    memset(links, 0, sizeof(links));
+    links[CHAN_AB].name = "A->B";
+    links[CHAN_AB].src = sa;
+    links[CHAN_AB].dst = sb;
+    links[CHAN_AB].chan = &chan[CHAN_AB];
+    links[CHAN_BA].name = "B->A";
+    links[CHAN_BA].src = sb;
+    links[CHAN_BA].dst = sa;
+    links[CHAN_BA].chan = &chan[CHAN_BA];
+}
+
+static void print_stat(void)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        lprintf("%s %s: %u bytes, queue %d bytes, Err %d (%.1e)", i ? "," : "....", links[i].name,
+            links[i].bytes, links[i].queued, links[i].noise, links[i].nbits ? (double)links[i].noise / links[i].nbits : 0.0);
+    }
+    lprintf("\n");
+}
+
+static void quit(char *why)
+{
+    lprintf("%s\n", why);
+    print_stat();
+    lprintf("Quit.\n");
+    exit(0);
+}
+
+static void append(struct BLK **head, struct BLK **tail, struct BLK *blk)
+{
+    blk->link = NULL;
+    if (*head == NULL)
+        *head = *tail = blk;
+    else {
+        (*tail)->link = blk;
+        *tail = blk;
+    }
+}
+
+/* station -> in-queue, not read while the in-queue is full */
+static void link_recv(struct LINK *l)
+{
+    struct BLK *blk;
+    int n;
+
+    blk = (struct BLK *)malloc(sizeof(struct BLK) + RECV_SIZE);
+    if (blk == NULL)
+        ABORT("No enough memory");
+
+    blk->rptr = 0;
+    blk->wptr = n = recv(l->src, (char *)blk->data, RECV_SIZE, 0);
+    if (n <= 0) {
+        free(blk);
+        if (n < 0 && sock_again())
+            return;
+        quit("TCP disconnected.");
+    }
+
+    l->queued += blk->wptr;
+    append(&l->in_head, &l->in_tail, blk);
+}
+
+/* in-queue -> channel, at channel rate, with bit errors; idle while the receiving station stalls */
+static void link_send(struct LINK *l)
+{
+    struct BLK *blk, *in;
+    long long n1000;
+    int n, m, k;
+
+    if (l->last_ts == 0)
+        l->last_ts = now;
+    if (now <= l->last_ts)
+        return;
+
+    /* 2 bytes on the wire per frame byte */
+    n1000 = (long long)(now - l->last_ts) * l->chan->bps * 2 / 8 + l->allowed_frac;
+    l->allowed_frac = (int)(n1000 % 1000);
+    l->last_ts = now;
+
+    n = (int)(n1000 / 1000);
+    if (n > l->queued)
+        n = l->queued;
+    if (n > QUEUE_MAX - l->flying)
+        n = QUEUE_MAX - l->flying;
+    if (n <= 0)
+        return;
+
+    blk = (struct BLK *)malloc(sizeof(struct BLK) + n);
+    if (blk == NULL)
+        ABORT("No enough memory");
+    blk->rptr = 0;
+    blk->wptr = n;
+
+    for (m = 0; m < n; m += k) {
+        in = l->in_head;
+        k = in->wptr - in->rptr;
+        if (k > n - m)
+            k = n - m;
+        memcpy(blk->data + m, in->data + in->rptr, k);
+        in->rptr += k;
+        if (in->rptr == in->wptr) {
+            l->in_head = in->link;
+            free(in);
+        }
+    }
+    l->queued -= n;
+    l->bytes += n;
+
+    /* Impose noise */
+    l->nbits += n * 4;
+    if (impose_noise(&noise_seed, blk->data, n, 4, l->chan->ber, (double)l->noise / l->nbits)) {
+        l->noise++;
+        if (debug_mask & 0x04)
+            lprintf("Impose noise on %s, %u/%u=%.1E\n", l->name, l->noise, l->nbits, (double)l->noise / l->nbits);
+    }
+
+    blk->commit_ts = now + l->chan->delay;
+    l->flying += n;
+    append(&l->fly_head, &l->fly_tail, blk);
+}
+
+/* channel -> receiving station */
+static void link_commit(struct LINK *l)
+{
+    struct BLK *blk;
+    int n;
+
+    while ((blk = l->fly_head) != NULL && blk->commit_ts <= now) {
+        n = send(l->dst, (char *)blk->data + blk->rptr, blk->wptr - blk->rptr, 0);
+        if (n < 0 && sock_again())
+            break;
+        if (n <= 0)
+            quit("TCP disconnected.");
+        blk->rptr += n;
+        l->flying -= n;
+        if (blk->rptr < blk->wptr)
+            break;
+        l->fly_head = blk->link;
+        free(blk);
+    }
+}
+
+static void schedule_update(void)
+{
+    if (cur_phase + 1 >= nphase || phases[cur_phase + 1].start > now)
+        return;
+
+    while (cur_phase + 1 < nphase && phases[cur_phase + 1].start <= now)
+        cur_phase++;
+    memcpy(chan, phases[cur_phase].chan, sizeof(chan));
+
+    lprintf("#### Phase %d begins: A->B %d bps %d ms %.1E, B->A %d bps %d ms %.1E\n", cur_phase,
+        chan[CHAN_AB].bps, chan[CHAN_AB].delay, chan[CHAN_AB].ber,
+        chan[CHAN_BA].bps, chan[CHAN_BA].delay, chan[CHAN_BA].ber);
+}
+
+int main(int argc, char **argv)
+{
+    fd_set rfd, wfd;
+    struct timeval tm;
+    int i, maxfd, last_stat = 0;
+
+    socket_init();
+    config(argc, argv);
+    noise_seed = mode_seed;
+
+    accept_stations();
+    maxfd = links[0].src > links[1].src ? links[0].src : links[1].src;
+
+    for (;;) {
+        now = get_ms();
+        schedule_update();
+
+        tm.tv_sec = 0;
+        tm.tv_usec = EMU_TICK * 1000;
+        FD_ZERO(&rfd);
+        FD_ZERO(&wfd);
+        for (i = 0; i < 2; i++) {
+            if (links[i].queued < QUEUE_MAX)
+                FD_SET(links[i].src, &rfd);
+            if (links[i].fly_head && links[i].fly_head->commit_ts <= now)
+                FD_SET(links[i].dst, &wfd);
+        }
+
+        if (select(maxfd + 1, &rfd, &wfd, 0, &tm) < 0)
+            ABORT("system select()");
+
+        now = get_ms();
+        for (i = 0; i < 2; i++) {
+            if (FD_ISSET(links[i].src, &rfd))
+                link_recv(&links[i]);
+            link_send(&links[i]);
+            link_commit(&links[i]);
+        }
+
+        if (now - last_stat >= STAT_INTERVAL) {
+            print_stat();
+            last_stat = now;
+        }
+
+        if (now > mode_life)
+            quit("Time to live expired.");
+    }
+}
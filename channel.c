@@ -0,0 +1,236 @@
+#ifndef	_CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef _WIN32
+#define stricmp _stricmp
+#else
+#include <strings.h>
+#define stricmp strcasecmp
+#endif
+
+#include "lprintf.h"
+#include "channel.h"
+
+#define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+
+double parse_ber(char *arg)
+{
+	double v = strtod(arg, 0);
+
+	if (v < 0.0 || v >= 1.0) {
+		printf("Bad BER %.3f\n", v);
+		exit(0);
+	}
+	return v;
+}
+
+int parse_bps(char *arg)
+{
+	int v = atoi(arg);
+
+	if (v < 100 || v > 100000000) {
+		printf("Bad channel rate %s (100~100000000 bps)\n", arg);
+		exit(0);
+	}
+	return v;
+}
+
+int parse_delay(char *arg)
+{
+	int v = atoi(arg);
+
+	if (v < 10 || v > 60000) {
+		printf("Bad propagation delay %s (10~60000 ms)\n", arg);
+		exit(0);
+	}
+	return v;
+}
+
+int channel_option(int opt, char *arg, struct CHANNEL *chan)
+{
+	switch (opt) {
+	case 'u':
+		chan[CHAN_AB].ber = chan[CHAN_BA].ber = 0.0;
+		break;
+
+	case 'b':
+		chan[CHAN_AB].ber = chan[CHAN_BA].ber = parse_ber(arg);
+		break;
+
+	case OPT_BER_AB:
+	case OPT_BER_BA:
+		chan[opt == OPT_BER_AB ? CHAN_AB : CHAN_BA].ber = parse_ber(arg);
+		break;
+
+	case OPT_BPS:
+		chan[CHAN_AB].bps = chan[CHAN_BA].bps = parse_bps(arg);
+		break;
+
+	case OPT_BPS_AB:
+	case OPT_BPS_BA:
+		chan[opt == OPT_BPS_AB ? CHAN_AB : CHAN_BA].bps = parse_bps(arg);
+		break;
+
+	case OPT_DELAY:
+		chan[CHAN_AB].delay = chan[CHAN_BA].delay = parse_delay(arg);
+		break;
+
+	case OPT_DELAY_AB:
+	case OPT_DELAY_BA:
+		chan[opt == OPT_DELAY_AB ? CHAN_AB : CHAN_BA].delay = parse_delay(arg);
+		break;
+
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+/*
+    Channel schedule file, one phase per line:
+
+        <start-second> [ab|ba] <ber> [<bps> [<delay-ms>]]
+
+    '-' keeps the value of the previous phase, a missing direction applies
+    the line to both directions, '#' starts a comment. Lines with the same
+    start time are merged, so a measured trace is replayed by listing its
+    samples one per line.
+*/
+int load_schedule(char *fname, struct CHANNEL *chan, struct PHASE **pphases)
+{
+    FILE *fp;
+    char line[256], *tok[5], msg[512];
+    int  lineno = 0, ntok, i, first, d, d0, d1;
+    double t;
+    struct PHASE *phases, *ph;
+    int nphase = 0, max_phase = 64;
+
+    if ((fp = fopen(fname, "r")) == NULL) {
+        sprintf(msg, "Failed to open channel schedule \"%s\"", fname);
+        ABORT(msg);
+    }
+
+    phases = (struct PHASE *)malloc(max_phase * sizeof(struct PHASE));
+    if (phases == NULL)
+        ABORT("No enough memory");
+
+    while (fgets(line, sizeof(line), fp)) {
+        lineno++;
+        if (strchr(line, '#'))
+            *strchr(line, '#') = 0;
+        for (ntok = 0; ntok < 5 && (tok[ntok] = strtok(ntok ? NULL : line, " \t\r\n")) != NULL; ntok++)
+            ;
+        if (ntok == 0)
+            continue;
+
+        t = strtod(tok[0], 0);
+        if (t < 0.0 || (nphase && (int)(t * 1000) < phases[nphase - 1].start))
+            goto bad;
+
+        d0 = CHAN_AB;
+        d1 = CHAN_BA;
+        i = 1;
+        if (ntok > 1 && stricmp(tok[1], "ab") == 0)
+            d1 = d0, i++;
+        else if (ntok > 1 && stricmp(tok[1], "ba") == 0)
+            d0 = d1, i++;
+        if (i == ntok)
+            goto bad;
+
+        if (nphase == 0 || (int)(t * 1000) != phases[nphase - 1].start) {
+            if (nphase == max_phase) {
+                max_phase *= 2;
+                phases = (struct PHASE *)realloc(phases, max_phase * sizeof(struct PHASE));
+                if (phases == NULL)
+                    ABORT("No enough memory");
+            }
+            ph = &phases[nphase];
+            memcpy(ph->chan, nphase ? phases[nphase - 1].chan : chan, sizeof(ph->chan));
+            ph->start = (int)(t * 1000);
+            nphase++;
+        } else
+            ph = &phases[nphase - 1];
+
+        /* <ber> [<bps> [<delay>]] */
+        for (first = i; i < ntok; i++) {
+            if (strcmp(tok[i], "-") == 0)
+                continue;
+            for (d = d0; d <= d1; d++) {
+                if (i == first)
+                    ph->chan[d].ber = parse_ber(tok[i]);
+                else if (i == first + 1)
+                    ph->chan[d].bps = parse_bps(tok[i]);
+                else if (i == first + 2)
+                    ph->chan[d].delay = parse_delay(tok[i]);
+                else
+                    goto bad;
+            }
+        }
+    }
+    fclose(fp);
+
+    /* callers report the last phase, an empty schedule has none */
+    if (nphase == 0) {
+        sprintf(msg, "Empty channel schedule \"%s\"", fname);
+        ABORT(msg);
+    }
+
+    *pphases = phases;
+    return nphase;
+
+bad:
+    sprintf(msg, "Bad channel schedule \"%s\", line %d", fname, lineno);
+    ABORT(msg);
+    return 0;
+}
+
+void print_channel(char *dir, struct CHANNEL *c)
+{
+	lprintf("Channel %s: %d bps, %d ms propagation delay, bit error rate ", dir, c->bps, c->delay);
+	if (c->ber > 0.0)
+		lprintf("%.1E\n", c->ber);
+	else
+		lprintf("0\n");
+}
+
+/* xorshift32, 0 ~ CHAN_RAND_MAX */
+int chan_rand(unsigned int *seed)
+{
+    unsigned int x = *seed ? *seed : 0x9e3779b9;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *seed = x;
+    return (int)(x >> 1);
+}
+
+/*
+    'rate' is the error rate imposed so far, it steers the probability
+    toward 'ber'. Return 1 if a bit of 'data' is flipped.
+*/
+int impose_noise(unsigned int *seed, unsigned char *data, int len, int bits, double ber, double rate)
+{
+    double a, fact;
+    unsigned char *p;
+
+    if (ber == 0.0 || len <= 0)
+        return 0;
+
+    fact = rate > ber ? 3.5 : 6.0;
+    a = (1.0 - pow(1.0 - ber, fact * len * bits / 4)) * (CHAN_RAND_MAX + 1.0);
+    if (chan_rand(seed) < a) {
+        p = &data[chan_rand(seed) % len];
+        if (bits == 8 || (*p & 0x0f)) {
+            *p ^= 1 << (chan_rand(seed) % 8);
+            return 1;
+        }
+    }
+    return 0;
+}
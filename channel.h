@@ -0,0 +1,84 @@
+#ifndef __CHANNEL_H__
+#define __CHANNEL_H__
+
+#ifdef  __cplusplus
+extern "C" {
+#endif
+
+#define DEFAULT_CHAN_DELAY 270       /* ms */
+#define DEFAULT_CHAN_BPS   8000      /* bits per second */
+#define DEFAULT_CHAN_BER   1.0E-5    /* Bit Error Rate */
+#define DEFAULT_PORT  59144
+
+/* channel parameters, one set per direction */
+#define CHAN_AB 0   /* A -> B */
+#define CHAN_BA 1   /* B -> A */
+
+struct CHANNEL {
+    int    bps;     /* bits per second, imposed by the sender */
+    int    delay;   /* propagation delay (ms), imposed by the receiver */
+    double ber;     /* Bit Error Rate, imposed by the receiver */
+};
+
+/* channel schedule: piecewise-constant phases, or a replayed trace */
+struct PHASE {
+    int start;                  /* ms since epoch */
+    struct CHANNEL chan[2];     /* parameters of both directions */
+};
+
+/* long-only options shared by the stations and chanemu */
+enum {
+    OPT_BER_AB = 256, OPT_BER_BA,
+    OPT_BPS, OPT_BPS_AB, OPT_BPS_BA,
+    OPT_DELAY, OPT_DELAY_AB, OPT_DELAY_BA,
+    OPT_SCHEDULE,
+    OPT_CHANNEL_LAST
+};
+
+#define CHANNEL_LONG_OPTIONS \
+	{ "ber",	required_argument, NULL, 'b' }, \
+	{ "ber-ab", required_argument, NULL, OPT_BER_AB }, \
+	{ "ber-ba", required_argument, NULL, OPT_BER_BA }, \
+	{ "bps",    required_argument, NULL, OPT_BPS }, \
+	{ "bps-ab", required_argument, NULL, OPT_BPS_AB }, \
+	{ "bps-ba", required_argument, NULL, OPT_BPS_BA }, \
+	{ "delay",  required_argument, NULL, OPT_DELAY }, \
+	{ "delay-ab", required_argument, NULL, OPT_DELAY_AB }, \
+	{ "delay-ba", required_argument, NULL, OPT_DELAY_BA }, \
+	{ "schedule", required_argument, NULL, OPT_SCHEDULE }
+
+#define __CHAN_STR(x) #x
+#define CHAN_STR(x) __CHAN_STR(x)
+
+#define CHANNEL_USAGE \
+	"    -u, --utopia : utopia channel (an error-free channel)\n" \
+	"    -b, --ber=<ber> : Bit Error Rate (received data only)\n" \
+	"    --ber-ab=<ber>, --ber-ba=<ber> : Bit Error Rate of A->B / B->A\n" \
+	"    --bps=<bps> : channel rate of both directions (default: " CHAN_STR(DEFAULT_CHAN_BPS) ")\n" \
+	"    --bps-ab=<bps>, --bps-ba=<bps> : channel rate of A->B / B->A\n" \
+	"    --delay=<ms> : propagation delay of both directions (default: " CHAN_STR(DEFAULT_CHAN_DELAY) ")\n" \
+	"    --delay-ab=<ms>, --delay-ba=<ms> : propagation delay of A->B / B->A\n" \
+	"    --schedule=<filename> : time-varying channel schedule or trace\n"
+
+extern double parse_ber(char *arg);
+extern int    parse_bps(char *arg);
+extern int    parse_delay(char *arg);
+
+/* handle 'u', 'b' and OPT_BER_AB ~ OPT_DELAY_BA, return 0 for other options */
+extern int channel_option(int opt, char *arg, struct CHANNEL *chan);
+
+extern int  load_schedule(char *fname, struct CHANNEL *chan, struct PHASE **phases);
+extern void print_channel(char *dir, struct CHANNEL *c);
+
+/* a generator per station, rand() is shared by the worker threads of a fleet */
+#define CHAN_RAND_MAX 0x7fffffff
+extern int  chan_rand(unsigned int *seed);
+
+/* Bit errors on data carrying 'bits' (4: nibble-encoded, 8: COBS) per byte, at most one per call */
+extern int  impose_noise(unsigned int *seed, unsigned char *data, int len, int bits, double ber, double rate);
+
+#ifdef  __cplusplus
+}
+#endif
+
+#endif
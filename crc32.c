@@ -59,19 +59,280 @@ static const unsigned int crc_table[256] = {
     0x2d02ef8dL
 };
 
+/* bytes per step of crc32(): 1 (one table), 8 or 16 (slicing-by-8/16) */
+#ifndef CRC_SLICE
+#define CRC_SLICE 16
+#endif
+
+/* folding by carry-less multiplication on x86, if the CPU has it; -DCRC_CLMUL=0 to leave out */
+#ifndef CRC_CLMUL
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define CRC_CLMUL 1
+#else
+#define CRC_CLMUL 0
+#endif
+#endif
+
+#if CRC_CLMUL
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET(s)
+#else
+#include <cpuid.h>
+#define TARGET(s) __attribute__((target(s)))
+#endif
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#include <immintrin.h>
+#endif
+
+/* 
+    Slicing: crc_slice[k][b] is the CRC of byte b followed by k zero bytes, 
+    so one step looks up each of the next CRC_SLICE bytes in a table of its 
+    own. crc_slice[0] is crc_table. Built by crc32_setup().
+*/
+static unsigned int crc_slice[16][256];
+static int crc_ready = 0;
+
+#if CRC_CLMUL
+/* 
+    Folding (Intel, "Fast CRC Computation for Generic Polynomials Using 
+    PCLMULQDQ Instruction"): a 128-bit block is multiplied by x^(d+32) and 
+    x^(d-32) mod P, the bit-reflected constants below, and added to the 
+    block d bits on, until 128 bits are left for the Barrett reduction.
+    crc_fold() takes a multiple of 16 bytes, at least CRC_FOLD_MIN.
+*/
+#define CRC_FOLD_MIN 64
+
+static unsigned int (*crc_fold)(unsigned int crc, unsigned char *buf, int len);
+
+#define K_1056 0x1e88ef372ULL   /* d = 1024: four 256-bit blocks */
+#define K_992  0x14a7fe880ULL
+#define K_544  0x154442bd4ULL   /* d = 512: four 128-bit blocks */
+#define K_480  0x1c6e41596ULL
+#define K_160  0x1751997d0ULL   /* d = 128 */
+#define K_96   0x0ccaa009eULL
+#define K_64   0x163cd6124ULL
+#define P_X    0x1db710641ULL   /* P and floor(x^64 / P), reflected */
+#define MU     0x1f7011641ULL
+
+#define FOLD(x, k, y) _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), \
+    _mm_clmulepi64_si128(x, k, 0x11)), y)
+
+/* the 16-byte blocks left, then from 128 bits down to 32 */
+TARGET("pclmul,sse2")
+static unsigned int fold_reduce(__m128i x1, unsigned char *buf, int len)
+{
+    __m128i k, x2, mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+    k = _mm_set_epi64x(K_96, K_160);
+    for (; len >= 16; len -= 16, buf += 16)
+        x1 = FOLD(x1, k, _mm_loadu_si128((__m128i *)buf));
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    k = _mm_set_epi64x(0, K_64);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction */
+    k = _mm_set_epi64x(MU, P_X);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), k, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+TARGET("pclmul,sse2")
+static unsigned int crc_fold_128(unsigned int crc, unsigned char *buf, int len)
+{
+    __m128i k, x1, x2, x3, x4;
+
+    x1 = _mm_xor_si128(_mm_loadu_si128((__m128i *)buf), _mm_cvtsi32_si128((int)crc));
+    x2 = _mm_loadu_si128((__m128i *)(buf + 16));
+    x3 = _mm_loadu_si128((__m128i *)(buf + 32));
+    x4 = _mm_loadu_si128((__m128i *)(buf + 48));
+    buf += 64;
+    len -= 64;
+
+    k = _mm_set_epi64x(K_480, K_544);
+    for (; len >= 64; len -= 64, buf += 64) {
+        x1 = FOLD(x1, k, _mm_loadu_si128((__m128i *)buf));
+        x2 = FOLD(x2, k, _mm_loadu_si128((__m128i *)(buf + 16)));
+        x3 = FOLD(x3, k, _mm_loadu_si128((__m128i *)(buf + 32)));
+        x4 = FOLD(x4, k, _mm_loadu_si128((__m128i *)(buf + 48)));
+    }
+
+    k = _mm_set_epi64x(K_96, K_160);
+    x1 = FOLD(x1, k, x2);
+    x1 = FOLD(x1, k, x3);
+    x1 = FOLD(x1, k, x4);
+    return fold_reduce(x1, buf, len);
+}
+
+#define FOLD256(y, k, z) _mm256_xor_si256(_mm256_xor_si256(_mm256_clmulepi64_epi128(y, k, 0x00), \
+    _mm256_clmulepi64_epi128(y, k, 0x11)), z)
+
+/* VPCLMULQDQ: two blocks per instruction, 128 bytes per round */
+TARGET("vpclmulqdq,pclmul,avx2")
+static unsigned int crc_fold_256(unsigned int crc, unsigned char *buf, int len)
+{
+    __m256i k, y1, y2, y3, y4;
+    __m128i x, k128;
+
+    if (len < 256)
+        return crc_fold_128(crc, buf, len);
+
+    y1 = _mm256_xor_si256(_mm256_loadu_si256((__m256i *)buf), _mm256_zextsi128_si256(_mm_cvtsi32_si128((int)crc)));
+    y2 = _mm256_loadu_si256((__m256i *)(buf + 32));
+    y3 = _mm256_loadu_si256((__m256i *)(buf + 64));
+    y4 = _mm256_loadu_si256((__m256i *)(buf + 96));
+    buf += 128;
+    len -= 128;
+
+    k = _mm256_set_epi64x(K_992, K_1056, K_992, K_1056);
+    for (; len >= 128; len -= 128, buf += 128) {
+        y1 = FOLD256(y1, k, _mm256_loadu_si256((__m256i *)buf));
+        y2 = FOLD256(y2, k, _mm256_loadu_si256((__m256i *)(buf + 32)));
+        y3 = FOLD256(y3, k, _mm256_loadu_si256((__m256i *)(buf + 64)));
+        y4 = FOLD256(y4, k, _mm256_loadu_si256((__m256i *)(buf + 96)));
+    }
+
+    /* the eight 128-bit blocks in order */
+    k128 = _mm_set_epi64x(K_96, K_160);
+    x = _mm256_castsi256_si128(y1);
+    x = FOLD(x, k128, _mm256_extracti128_si256(y1, 1));
+    x = FOLD(x, k128, _mm256_castsi256_si128(y2));
+    x = FOLD(x, k128, _mm256_extracti128_si256(y2, 1));
+    x = FOLD(x, k128, _mm256_castsi256_si128(y3));
+    x = FOLD(x, k128, _mm256_extracti128_si256(y3, 1));
+    x = FOLD(x, k128, _mm256_castsi256_si128(y4));
+    x = FOLD(x, k128, _mm256_extracti128_si256(y4, 1));
+    return fold_reduce(x, buf, len);
+}
+
+static void cpu_id(int leaf, unsigned int r[4])
+{
+#ifdef _MSC_VER
+    __cpuidex((int *)r, leaf, 0);
+#else
+    __cpuid_count(leaf, 0, r[0], r[1], r[2], r[3]);
+#endif
+}
+
+/* PCLMULQDQ, and VPCLMULQDQ with AVX2 if the OS saves the YMM registers */
+static void crc_dispatch(void)
+{
+    unsigned int r[4], xcr0 = 0;
+
+    cpu_id(0, r);
+    if (r[0] < 1)
+        return;
+    cpu_id(1, r);
+    if (!(r[2] & (1 << 1)))                           /* PCLMULQDQ */
+        return;
+    crc_fold = crc_fold_128;
+
+    if (!(r[2] & (1 << 27)) || !(r[2] & (1 << 28)))   /* OSXSAVE, AVX */
+        return;
+#ifdef _MSC_VER
+    xcr0 = (unsigned int)_xgetbv(0);
+#else
+    __asm__ ("xgetbv" : "=a" (xcr0) : "c" (0) : "edx");
+#endif
+    if ((xcr0 & 6) != 6)
+        return;
+    cpu_id(0, r);
+    if (r[0] < 7)
+        return;
+    cpu_id(7, r);
+    if ((r[1] & (1 << 5)) && (r[2] & (1 << 10)))      /* AVX2, VPCLMULQDQ */
+        crc_fold = crc_fold_256;
+}
+#endif
+
 #define DO1(buf) crc = crc_table[((int)crc ^ (*buf++)) & 0xff] ^ (crc >> 8);
 #define DO2(buf)  DO1(buf); DO1(buf);
 #define DO4(buf)  DO2(buf); DO2(buf);
 #define DO8(buf)  DO4(buf); DO4(buf);
 
-unsigned int crc32(unsigned char *buf, int len)
+/* little-endian word whatever the CPU */
+#define WORD(p) ((unsigned int)(p)[0] | (unsigned int)(p)[1] << 8 | (unsigned int)(p)[2] << 16 | (unsigned int)(p)[3] << 24)
+
+#define SLICE(k, w) (crc_slice[k][(w) & 0xff] ^ crc_slice[(k) - 1][((w) >> 8) & 0xff] \
+    ^ crc_slice[(k) - 2][((w) >> 16) & 0xff] ^ crc_slice[(k) - 3][(w) >> 24])
+
+void crc32_setup(void)
+{
+    int i, k;
+
+    for (i = 0; i < 256; i++) {
+        crc_slice[0][i] = crc_table[i];
+        for (k = 1; k < 16; k++)
+            crc_slice[k][i] = crc_table[crc_slice[k - 1][i] & 0xff] ^ (crc_slice[k - 1][i] >> 8);
+    }
+#if CRC_CLMUL
+    crc_dispatch();
+#endif
+    crc_ready = 1;
+}
+
+/* 
+    Streaming: crc32_final(crc32_update(crc32_init(), buf, len)) is crc32(buf, 
+    len), the frame may come in pieces of any length.
+*/
+unsigned int crc32_init(void)
 {
-    unsigned int crc = 0xffffffffL;
+    return 0xffffffffL;
+}
 
+/* no final XOR, the CRC of a frame followed by its CRC is 0 */
+unsigned int crc32_final(unsigned int crc)
+{
+    return crc;
+}
+
+unsigned int crc32_update(unsigned int crc, unsigned char *buf, int len)
+{
+#if CRC_SLICE > 1
+    unsigned int w0, w1;
+#endif
+#if CRC_SLICE == 16
+    unsigned int w2, w3;
+#endif
+
+    if (!crc_ready)
+        crc32_setup();
+
+#if CRC_CLMUL
+    if (crc_fold && len >= CRC_FOLD_MIN) {
+        crc = crc_fold(crc, buf, len & ~15);
+        buf += len & ~15;
+        len &= 15;
+    }
+#endif
+
+#if CRC_SLICE > 1
+    for (; len >= CRC_SLICE; len -= CRC_SLICE, buf += CRC_SLICE) {
+        w0 = WORD(buf) ^ crc;
+        w1 = WORD(buf + 4);
+#if CRC_SLICE == 16
+        w2 = WORD(buf + 8);
+        w3 = WORD(buf + 12);
+        crc = SLICE(15, w0) ^ SLICE(11, w1) ^ SLICE(7, w2) ^ SLICE(3, w3);
+#else
+        crc = SLICE(7, w0) ^ SLICE(3, w1);
+#endif
+    }
+#else
     while (len >= 8) {
         DO8(buf);
         len -= 8;
     }
+#endif
 
     if (len) {
         do {
@@ -82,6 +343,11 @@ unsigned int crc32(unsigned char *buf, int len)
     return crc;
 }
 
+unsigned int crc32(unsigned char *buf, int len)
+{
+    return crc32_final(crc32_update(crc32_init(), buf, len));
+}
+
 #if 0
 
 #include <stdio.h>
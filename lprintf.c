@@ -6,9 +6,11 @@
 #endif
 
 #include <windows.h>
+#define THREAD_LOCAL __declspec(thread)
 
 #else
 #define __int64 long long
+#define THREAD_LOCAL __thread
 #endif
 
 #include <sys/types.h>
@@ -22,6 +24,8 @@
 
 FILE *log_file = NULL;
 
+static THREAD_LOCAL int quiet = 0; /* drop the output of this thread */
+
 #define bool int
 #define true 1
 #define false 0
@@ -361,6 +365,11 @@ static int output_memory_block(const unsigned char *ptr, int n,
     return len;
 }
 
+void lprintf_quiet(int on)
+{
+    quiet = on;
+}
+
 int __v_lprintf(const char *format, va_list arg_ptr)
 {
     unsigned int len = 0;
@@ -379,6 +388,9 @@ int __v_lprintf(const char *format, va_list arg_ptr)
     __int64 num;
     char *prefix;
     int prefix_len; /* 0x 0X 0 - + ' ' */
+
+    if (quiet)
+        return 0;
     
     while (*format) {
         
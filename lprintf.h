@@ -13,6 +13,7 @@ extern unsigned int get_ms(void);
 
 int lprintf(const char *format, ...);
 int __v_lprintf(const char *format, va_list arg_ptr);
+void lprintf_quiet(int on);
 
 #ifdef __cplusplus
 }
@@ -10,6 +10,8 @@ static time_t epoch; /* epoch timestamp (be same for Station A & B) */
 
 #include <winsock.h>
 #include <io.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/timeb.h>
@@ -17,6 +19,11 @@ static time_t epoch; /* epoch timestamp (be same for Station A & B) */
 
 #define getopt_long getopt_int
 #define stricmp _stricmp
+#define strnicmp _strnicmp
+#define sleep_us(us) Sleep(((us) + 999) / 1000)
+#define sock_again() (WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAETIMEDOUT)
+#define sock_nonblock(s) do { u_long on = 1; ioctlsocket(s, FIONBIO, &on); } while (0)
+#define THREAD_LOCAL __declspec(thread)
 
 static void socket_init(void)
 {
@@ -41,6 +48,16 @@ unsigned int get_ms(void)
 	return (unsigned int)(epoch ? (tm.time - epoch) * 1000 + tm.millitm : 0);
 }
 
+/* get_ms() stays 0 until the stations agree on the epoch */
+static unsigned int wall_ms(void)
+{
+	struct _timeb tm;
+
+	_ftime(&tm);
+
+	return (unsigned int)(tm.time * 1000 + tm.millitm);
+}
+
 #pragma comment(lib,"wsock32.lib")
 
 #else /* for Linux */
@@ -56,9 +73,22 @@ unsigned int get_ms(void)
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ucontext.h>
 #define stricmp strcasecmp
+#define strnicmp strncasecmp
 #define Sleep(ms) usleep((ms) * 1000)
-#define socket_init()
+#define sleep_us(us) usleep(us)
+#define closesocket close
+#define sock_again() (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+#define sock_nonblock(s) fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK)
+#define socket_init() signal(SIGPIPE, SIG_IGN) /* a broken link is reported by send() */
+#define THREAD_LOCAL __thread
+#define O_BINARY 0
 
 unsigned int get_ms(void)
 {
@@ -70,21 +100,122 @@ unsigned int get_ms(void)
 	return (unsigned int)(epoch ? (tm.tv_sec - epoch) * 1000 + tm.tv_usec / 1000 : 0);
 }
 
+/* get_ms() stays 0 until the stations agree on the epoch */
+static unsigned int wall_ms(void)
+{
+	struct timeval tm;
+
+	gettimeofday(&tm, NULL);
+
+	return (unsigned int)(tm.tv_sec * 1000 + tm.tv_usec / 1000);
+}
+
 #endif
 
 #include <math.h>
 
 #include "protocol.h"
+#include "channel.h"
 
-/* channel parameters */
-#define CHAN_DELAY 270       /* ms */
-#define CHAN_BPS   8000      /* bits per second */
-
-#define ABORT(s) do { lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
+#define ABORT(s) do { lprintf_quiet(0); lprintf("\nFATAL: %s\nAbort.\n", s); exit(0); } while(0)
 
 #define DEFAULT_TICK 15 /* ms */
-#define DEFAULT_CHAN_BER   1.0E-5    /* Bit Error Rate */
-#define DEFAULT_PORT  59144
+#define DEFAULT_SQ_MAX  (16 * 1024 * 1024)
+#define DEFAULT_SQ_HIGH (96 * 1024)
+#define DEFAULT_CONNECT_TIMEOUT 120  /* seconds */
+#define CONNECT_BACKOFF_MIN 100      /* us */
+#define CONNECT_BACKOFF_MAX 20000    /* us */
+#define RP_SIZE (512 * 1024) /* replay ring, more than the bytes TCP may hold in flight */
+#define MAX_LINKS 8          /* physical channels bonded into one session */
+#define BOND_CHECK 0xa5      /* bond header: sequence No., sequence No. ^ BOND_CHECK */
+#define BOND_HDR   (nlink > 1 ? 2 : 0)
+#define CRC_CHUNK  256       /* CRC taken while the bytes are in the cache, see send_frame_crc() */
+#define MAX_FLEET 100000     /* station pairs hosted by one process */
+#define FLEET_STACK (64 * 1024)  /* of each instance of the datalink program */
+#define FLEET_SQ_SIZE (4 * 1024) /* initial sending queue of an instance, grown on demand */
+#define DEFAULT_RELAY_QUEUE 64   /* packets waiting for the next hop */
+#define DEFAULT_TRAFFIC_QUEUE 64 /* generated packets waiting for the datalink */
+#define FLOOD_CREDIT 64          /* packets offered at once by an endless source */
+#define FILE_CHUNK (16 * 1024 * 1024) /* the file received is preallocated by this much */
+#define METER_SECONDS 64         /* one-second buckets kept, windows are up to 60 s */
+#define METER_WINDOWS 4
+
+/* wire format of frames */
+#define FRAMING_NIBBLE 0 /* 2 nibble bytes per frame byte, 0xff delimits */
+#define FRAMING_COBS   1 /* Consistent Overhead Byte Stuffing, 0x00 delimits */
+#define WIRE_BYTES(p) ((p)->framing == FRAMING_COBS ? 1 : 2) /* per frame byte */
+#define COBS_TAIL 0xa5   /* ends every COBS frame, see send_cobs() */
+
+/* packet length distribution, dictated by station A */
+#define SIZE_FIXED   0
+#define SIZE_UNIFORM 1   /* min ~ max */
+#define SIZE_BIMODAL 2   /* min or max, 'pct' percent of them min */
+#define PKT_HDR      7   /* packet No., send time (ms since the epoch), flow */
+#define PKT_RESENT   0x80 /* top bit of the send time: came in a retransmitted frame */
+#define MIN_PKT_LEN  PKT_HDR
+#define SIZE_CLASSES 12  /* goodput is reported for packets up to 32, 64, 128, ... 64K bytes */
+
+struct PKT_SIZES {
+    int dist, min, max, pct;
+};
+
+/* traffic generator of a station, TRAFFIC_LEGACY: flood or the busy/idle cycle */
+#define TRAFFIC_LEGACY  0
+#define TRAFFIC_CBR     1   /* constant bit rate, 'pps' packets per second */
+#define TRAFFIC_POISSON 2   /* Poisson arrivals, 'pps' on average */
+#define TRAFFIC_ONOFF   3   /* 'pps' during on periods, Pareto on/off periods */
+#define TRAFFIC_BACKLOG 4   /* the queue is always full */
+
+struct TRAFFIC {
+    int model;
+    double pps;
+    double on_ms, off_ms;   /* mean on/off period */
+    double shape;           /* of the Pareto distribution */
+};
+
+static char *traffic_names[] = { "legacy", "cbr", "poisson", "onoff", "backlog" };
+
+/* 
+    Flows of packets of their own traffic and sizes. get_packet() serves the 
+    strict priority flows first, the lowest level first, and shares what is 
+    left among the weighted flows by deficit round robin.
+*/
+#define MAX_FLOWS   4
+#define DRR_QUANTUM 64      /* bytes per unit of weight per round */
+
+struct FLOW {
+    int prio;               /* strict priority level, -1: weighted */
+    int weight;
+    struct TRAFFIC traffic;
+    struct PKT_SIZES sizes;
+};
+
+/* 
+    File transfer: packets No. 30000~49999 carry a file, a type byte 
+    follows the packet No. The last one gives the size and the hash.
+*/
+#define FILE_PKT_NO 2       /* added to the station of the packet No. */
+#define FILE_DATA   0
+#define FILE_END    1       /* 8-byte size, 8-byte hash */
+#define FILE_HDR    (PKT_HDR + 1)   /* followed by the type */
+#define BULK_END    2       /* from station B, a BULK_SUMMARY, see --bulk */
+#define FNV_BASIS   0xcbf29ce484222325ULL
+#define FNV_PRIME   0x100000001b3ULL
+
+/* 
+    Bulk transfer: station A offers --bulk packets as fast as the datalink 
+    takes them, station B reports when the last one is delivered in order.
+*/
+#define BULK_RUNNING 0
+#define BULK_DONE    1      /* B: all delivered, the report is to send. A: report received */
+#define BULK_SENT    2      /* B: report fetched by the datalink */
+#define BULK_LINGER  10000  /* ms station B waits for station A to go */
+
+struct BULK_SUMMARY {
+    int ms;                 /* from sending the first packet to delivering the last */
+    unsigned int packets, lost, resent, naks, bad_crc;
+    long long bytes;
+};
 
 #define NMAGIC     32
 #define HEAD_MAGIC 0xa5a5e41b
@@ -92,30 +223,270 @@ unsigned int get_ms(void)
 
 static void magic_init(void);
 static void magic_check(void);
+static void state_init(void);
+static void sq_init(void);
+static void fleet_run(int argc, char **argv);
+static void relay_run(int argc, char **argv);
+static void fleet_yield(void);
+static void fleet_quit(void);
+static void file_open(void);
+static void station_quit(void);
 
 static unsigned int head_magic[NMAGIC];
 
 /* Parameters */
-static int station;
-static double ber = DEFAULT_CHAN_BER;  /* Bit Error Rate */
+static struct CHANNEL chan[2] = {
+    { DEFAULT_CHAN_BPS, DEFAULT_CHAN_DELAY, DEFAULT_CHAN_BER },
+    { DEFAULT_CHAN_BPS, DEFAULT_CHAN_DELAY, DEFAULT_CHAN_BER },
+};
+static int chan_assigned = 0; /* channel options given on command line */
+
+static struct PHASE *phases;
+static int nphase = 0;
+static char *schedule_file = NULL;
+
 static int mode_ibib = 0;    /* 0: BUSY-IDLE-BUSY-..., 1: IDLE-BUSY-BUSY-... */
 static int mode_flood = 0;   /* flood mode */
 static int mode_cycle = 100;  /* seconds */
 static int mode_life = 0x7fffff00;
 static int mode_tick = DEFAULT_TICK;
 static int mode_seed = 0x098bcde1;
+static int mode_proxy = 0;   /* connect to chanemu, which emulates the channel */
+static int sq_max = DEFAULT_SQ_MAX;   /* max. capacity of sending queue (bytes) */
+static int sq_high = DEFAULT_SQ_HIGH; /* high-water mark of sending queue (bytes) */
 static int debug_mask = 0; /* debug mask */
 static unsigned short port = DEFAULT_PORT;
 
-static int sock;
-static int now; /* timestamp (ms) */
-static int noise = 0; /* counter of bit errors */
+static int mode_canary = 0;  /* memory protection by magic words instead of guard pages */
+static int connect_timeout = DEFAULT_CONNECT_TIMEOUT; /* seconds */
+static int nlink = 1;        /* physical channels, dictated by station A */
+static int nlink_assigned = 0;
+
+static int fleet_pairs = 0;   /* station pairs hosted in this process, 0: one station */
+static int fleet_workers = 0; /* worker threads of the fleet, 0: one per CPU */
+static unsigned short relay_port = 0; /* a relay serves the next hop on this port */
+static int relay_queue = DEFAULT_RELAY_QUEUE;
+static int framing = FRAMING_NIBBLE; /* dictated by station A */
+static int framing_assigned = 0;
+static struct PKT_SIZES pkt_sizes = { SIZE_FIXED, PKT_LEN, PKT_LEN, 0 };
+static int pkt_sizes_assigned = 0;
+static struct TRAFFIC traffic = { TRAFFIC_LEGACY, 0.0, 0.0, 0.0, 0.0 };
+static int traffic_queue = DEFAULT_TRAFFIC_QUEUE;
+static struct FLOW flows[MAX_FLOWS];
+static int nflow = 0;        /* 0: one implicit flow, dictated by station A */
+static int meter_windows[METER_WINDOWS] = { 1, 10, 60 }; /* seconds */
+static int meter_nwin = 3;
+static char *send_file = NULL;  /* packets are sliced from it, "-": stdin */
+static char *recv_file = NULL;  /* the file from the peer is written to it */
+static int bulk_packets = 0;    /* offered by station A in all, dictated by station A */
+static int bulk_assigned = 0;
+
+static THREAD_LOCAL int now; /* timestamp (ms) */
+
+/* Run-time state, kept apart from the memory of the datalink program */
+
+#define NTIMER 129
+
+/* one physical channel: a TCP connection with its own queue, rate and noise */
+struct PHL {
+    int sock;
+
+    /* Sender */
+    unsigned char *sq;
+    int sq_size, sq_head, sq_tail;
+    int send_ts;
+    int send_bytes_allowed;
+    int send_bytes_frac;    /* fraction of a byte carried over (1/1000 byte) */
+    int vq_len;             /* bytes chanemu has not yet put on the channel */
+    unsigned char *rp;      /* replay ring: the last RP_SIZE bytes handed to TCP */
+    unsigned int tx_bytes;  /* bytes handed to TCP since the session began */
+    unsigned int rp_next, rp_end;   /* of the stream, still to replay after a resume */
+
+    /* Receiver */
+    struct BLK *rblk_head, *rblk_tail;
+    unsigned int nbits;
+    int noise;              /* counter of bit errors */
+    unsigned int rx_bytes;  /* bytes received from TCP since the session began */
+    struct RCV_FRAME *rf_buf;   /* frame being assembled */
+    unsigned char last_seq;     /* bond sequence No. of the last frame */
+    int seq_valid;
+};
+
+/* 
+    Payload bytes of a station's packets: the high bytes of an LCG, the 
+    stream is produced PAYLOAD_BATCH bytes ahead. 
+*/
+#define PAYLOAD_LANES 8
+#define PAYLOAD_BATCH ((PKT_LEN - 2) * 4)   /* a multiple of PAYLOAD_LANES */
+
+struct PAYLOAD_STREAM {
+    unsigned int holdrand;  /* LCG state after the last byte in buf */
+    unsigned int lenrand;   /* LCG of the packet lengths */
+    int head;               /* next byte to consume */
+    unsigned char buf[PAYLOAD_BATCH];
+};
+
+/* traffic of one second, for the goodput meter */
+struct METER_SEC {
+    unsigned int rx;        /* bytes of packets received */
+    unsigned int tx_frame;  /* bytes of frames sent */
+    unsigned int tx_pkt;    /* bytes of packets fetched */
+    unsigned int tx_wire;   /* frame bytes handed to TCP */
+};
+
+/* 
+    Latency histogram, HDR style: values below 64 ms are exact, above 
+    that each power of 2 has 32 buckets, so a value is off by 3% at most.
+*/
+#define LAT_SUB     6
+#define LAT_MAX_LOG 17      /* longer latencies count as 2^17 - 1 ms */
+#define LAT_BUCKETS ((LAT_MAX_LOG - LAT_SUB) * 32 + 64)
+
+struct LAT_HIST {
+    unsigned int cnt[LAT_BUCKETS];
+    unsigned int n, max;
+    double sum;
+};
+
+#define SENT_RING      64   /* packets fetched lately */
+#define PKT_OFF_MAX    32   /* the packet header is looked for in the first bytes of a frame */
+
+struct SENT_PKT {
+    unsigned char hdr[PKT_HDR];
+    unsigned char sends;    /* 0: empty, 1: fetched */
+};
+
+/* state of a flow, both directions */
+struct FLOW_STATE {
+    struct PAYLOAD_STREAM tx, rx;   /* of the packets sent, of the packets of the peer */
+    int pkt_no;
+    unsigned int rx_no;             /* packet No. expected next */
+    int rpackets;
+    double rbytes;
+    struct LAT_HIST lat[2];         /* packets sent once, retransmitted on the last hop */
+
+    /* Traffic generator */
+    int *tq;                        /* arrival time of the packets waiting */
+    int tq_head, tq_len;
+    double tg_next, tg_on_end;      /* next arrival, end of the on period */
+    int tg_ts0;
+    unsigned int tg_offered, tg_sent, tg_drops;
+    double tg_wait;                 /* ms spent in the queue by the packets sent */
+    int next_len;                   /* of the packet at the head, 0: not drawn yet */
+    int deficit;                    /* bytes the flow may send in this round */
+};
+
+/* a packet waiting in a relay for the next hop */
+struct RELAY_PKT {
+    int ts;                 /* queued at */
+    int len;
+    unsigned char *data;    /* pkt_len_max() bytes */
+};
+
+struct PROTOCOL_STATE {
+    int station;
+    unsigned short port;
+    int admin_sock;                         /* station A listens on it */
+    int resumes;                            /* sessions resumed so far */
+    unsigned int rand_seed;                 /* of chan_rand(), for noise and traffic */
+    struct CHANNEL chan[2];                 /* current channel parameters */
+    struct CHANNEL *tx_chan, *rx_chan;      /* my sending/receiving direction */
+    struct PHASE *phases;                   /* channel schedule */
+    int nphase, cur_phase;
+    int framing;
+    struct PKT_SIZES sizes;
+
+    /* Physical Layer */
+    struct PHL link[MAX_LINKS];
+    int rr;                 /* first link to try for the next frame */
+    int last_link;          /* link of the last frame sent */
+    int inform_phl_ready;
+    int phl_blocked;        /* send_frame() returned PHL_WOULD_BLOCK */
+    int blksize;
+    int rf_size;            /* of the frames being assembled, see rf_new() */
+    struct RCV_FRAME *rf_head, *rf_tail;    /* frames merged from all links */
+    unsigned char tx_seq, rx_seq;           /* bond sequence No. */
+    struct RCV_FRAME *reseq[256];           /* frames waiting for an earlier one */
+    int reseq_cnt, gap_ts;
+
+    /* Timer Management */
+    int timer[NTIMER];
+
+    /* Network Layer */
+    int network_layer_active, layer3_ts;
+    int layer3_credit;      /* packets get_packet() may fetch before the next NETWORK_LAYER_READY */
+    struct FLOW_STATE *flow;                /* allocated on first use, see flow_state() */
+    int drr;                                /* flow of this round */
+    int rpackets, rbytes;
+    int class_packets[SIZE_CLASSES], class_bytes[SIZE_CLASSES];
+    int ts0, stat_ts;
+    int phase_ts, phase_rbytes; /* goodput accounting of current schedule phase */
+    unsigned int tx_frame_bytes, tx_pkt_bytes;
+    struct METER_SEC meter[METER_SECONDS];  /* ring of the last seconds */
+    struct METER_SEC meter_base;            /* totals at the start of this second */
+    int meter_sec, meter_cnt;               /* this second, buckets filled */
+    int meter_ts;                           /* last printed */
+    struct SENT_PKT sent[SENT_RING];
+    int sent_next;
+    int pkt_off;            /* of the packet in the frames of the datalink program, -1: not known yet */
+
+    /* Fleet */
+    struct PROTOCOL_STATE *peer;    /* station in the same process, NULL with TCP */
+    unsigned int rframes;           /* frames handed to the datalink program */
+
+    /* Relay */
+    struct PROTOCOL_STATE *relay;   /* the other hop of a relay, received packets go there */
+    struct RELAY_PKT *rq;           /* packets to send on this hop */
+    int rq_head, rq_len, rq_peak, rq_drops;
+    unsigned int rq_out;
+    double rq_wait;                 /* ms spent in the queue by the packets sent */
+    int peer_relay;                 /* the peer is a relay, which may drop packets */
+    unsigned int lost;              /* packets dropped on the way */
+
+    /* File Transfer */
+    int fd;                         /* file sent, -1: none */
+    unsigned char *fmap;            /* the file mapped, NULL: a pipe */
+    long long fsize, fpos;
+    int feof, fdone;                /* end of the pipe, the last packet fetched */
+    unsigned long long fhash;
+    int f_ts0;
+    int ofd;                        /* file received, -1: only the hash is checked */
+    long long osize, oalloc;
+    unsigned long long ohash;
+    int o_ts0;
+
+    /* Bulk Transfer */
+    int bulk_state;
+    unsigned int bulk_fetched;      /* packets fetched by the datalink of station A */
+    int bulk_ts0, bulk_ts;          /* sending of the first packet, completion */
+    struct BULK_SUMMARY bulk;       /* of station B */
+    unsigned int resent_tx, resent_rx;      /* retransmitted frames, packets delivered from them */
+    unsigned int dl_count[NCOUNT];  /* reported by the datalink program, see dbg_count() */
+};
+
+static struct PROTOCOL_STATE canary_state;
+/* moved behind guard pages by state_init(), switched per instance by the fleet workers */
+static THREAD_LOCAL struct PROTOCOL_STATE *ps = &canary_state;
+
+struct INSTANCE;
+static THREAD_LOCAL struct INSTANCE *cur_inst; /* instance running on this thread, if any */
+
+static void session_resume(struct PHL *l);
+static void fleet_deliver(struct PHL *l, unsigned char *buf, int len);
 
 char *station_name(void)
 {
-    return (char *)(station == 'a' ? "A" : station == 'b' ? "B" : "XXX");
+    return (char *)(ps->station == 'a' ? "A" : ps->station == 'b' ? "B" : "XXX");
 }
 
+/* long-only options of the stations */
+enum {
+	OPT_SQ_MAX = OPT_CHANNEL_LAST, OPT_SQ_HIGH, OPT_CANARY, OPT_CONNECT_TIMEOUT, OPT_LINKS,
+	OPT_FLEET, OPT_WORKERS, OPT_RELAY, OPT_RELAY_QUEUE, OPT_FRAMING,
+	OPT_PKT_SIZE, OPT_TRAFFIC, OPT_TRAFFIC_QUEUE, OPT_SEND, OPT_RECV,
+	OPT_METER, OPT_FLOW, OPT_BULK,
+};
+
 static struct option intopts[] = {
 	{ "help",	no_argument, NULL, '?' },
 	{ "utopia", no_argument, NULL, 'u' },
@@ -124,13 +495,174 @@ static struct option intopts[] = {
 	{ "nolog",  no_argument, NULL, 'n' },
 	{ "debug",	required_argument, NULL, 'd' },
 	{ "port",	required_argument, NULL, 'p' },
-	{ "ber",	required_argument, NULL, 'b' },
 	{ "log",	required_argument, NULL, 'l' },
 	{ "ttl",    required_argument, NULL, 't' },
+	{ "chanemu", no_argument, NULL, 'x' },
+	{ "sq-max", required_argument, NULL, OPT_SQ_MAX },
+	{ "sq-high", required_argument, NULL, OPT_SQ_HIGH },
+	{ "canary", no_argument, NULL, OPT_CANARY },
+	{ "connect-timeout", required_argument, NULL, OPT_CONNECT_TIMEOUT },
+	{ "links", required_argument, NULL, OPT_LINKS },
+	{ "fleet", required_argument, NULL, OPT_FLEET },
+	{ "workers", required_argument, NULL, OPT_WORKERS },
+	{ "relay", required_argument, NULL, OPT_RELAY },
+	{ "relay-queue", required_argument, NULL, OPT_RELAY_QUEUE },
+	{ "framing", required_argument, NULL, OPT_FRAMING },
+	{ "pkt-size", required_argument, NULL, OPT_PKT_SIZE },
+	{ "traffic", required_argument, NULL, OPT_TRAFFIC },
+	{ "traffic-queue", required_argument, NULL, OPT_TRAFFIC_QUEUE },
+	{ "send", required_argument, NULL, OPT_SEND },
+	{ "recv", required_argument, NULL, OPT_RECV },
+	{ "meter", required_argument, NULL, OPT_METER },
+	{ "flow", required_argument, NULL, OPT_FLOW },
+	{ "bulk", required_argument, NULL, OPT_BULK },
+	CHANNEL_LONG_OPTIONS,
 	{ 0, 0, 0, 0 },
 };
 
-#define OPT_SHORT "?ufind:p:b:l:t:"
+#define OPT_SHORT "?ufinxd:p:b:l:t:"
+
+/* <len>, <min>-<max> or <small>,<large>[,<small%>] */
+static void parse_pkt_sizes(char *arg, struct PKT_SIZES *z)
+{
+    char c1 = 0, c2 = 0;
+    int n;
+
+    n = sscanf(arg, "%d%c%d%c%d", &z->min, &c1, &z->max, &c2, &z->pct);
+    if (n == 1) {
+        z->dist = SIZE_FIXED;
+        z->max = z->min;
+    } else if (n == 3 && c1 == '-')
+        z->dist = SIZE_UNIFORM;
+    else if ((n == 3 || n == 5) && c1 == ',' && (n == 3 || c2 == ',')) {
+        z->dist = SIZE_BIMODAL;
+        if (n == 3)
+            z->pct = 50;
+    } else
+        n = 0;
+
+    if (n == 0 || z->min < MIN_PKT_LEN || z->max > MAX_PKT_LEN || z->min > z->max 
+        || (z->dist == SIZE_BIMODAL && (z->pct < 0 || z->pct > 100))) {
+        printf("Bad packet size %s (%d~%d bytes)\n", arg, MIN_PKT_LEN, MAX_PKT_LEN);
+        exit(0);
+    }
+}
+
+/* <model>[:<pps>[,<on-ms>,<off-ms>[,<shape>]]] */
+static void parse_traffic(char *arg, struct TRAFFIC *t)
+{
+    char *p = strchr(arg, ':');
+    int n = 0, len = p ? (int)(p - arg) : (int)strlen(arg);
+
+    for (t->model = TRAFFIC_BACKLOG; t->model > TRAFFIC_LEGACY; t->model--) {
+        if ((int)strlen(traffic_names[t->model]) == len && strnicmp(arg, traffic_names[t->model], len) == 0)
+            break;
+    }
+    t->shape = 1.5;
+    if (p)
+        n = sscanf(p + 1, "%lf,%lf,%lf,%lf", &t->pps, &t->on_ms, &t->off_ms, &t->shape);
+
+    if (t->model == TRAFFIC_LEGACY 
+        || (t->model == TRAFFIC_BACKLOG && p) 
+        || ((t->model == TRAFFIC_CBR || t->model == TRAFFIC_POISSON) && n != 1)
+        || (t->model == TRAFFIC_ONOFF && n < 3)
+        || (t->model != TRAFFIC_BACKLOG && (t->pps <= 0.0 || t->pps > 100000.0))
+        || (t->model == TRAFFIC_ONOFF && (t->on_ms < 1.0 || t->off_ms < 1.0 || t->shape <= 1.0))) {
+        printf("Bad traffic model %s\n", arg);
+        exit(0);
+    }
+}
+
+/* <weight>|p<level>/<traffic>[/<pkt-size>] */
+static void parse_flow(char *arg)
+{
+    struct FLOW *w = &flows[nflow];
+    char buf[256], *sched, *model, *size, *end;
+
+    if (nflow == MAX_FLOWS) {
+        printf("Too many flows (up to %d)\n", MAX_FLOWS);
+        exit(0);
+    }
+    strncpy(buf, arg, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = 0;
+    sched = strtok(buf, "/");
+    model = strtok(NULL, "/");
+    size = strtok(NULL, "/");
+    if (sched == NULL || model == NULL || strtok(NULL, "/") != NULL)
+        goto bad;
+
+    if (tolower(sched[0]) == 'p') {
+        w->prio = (int)strtol(sched + 1, &end, 10);
+        w->weight = 0;
+        if (end == sched + 1 || *end || w->prio < 0 || w->prio > 9)
+            goto bad;
+    } else {
+        w->prio = -1;
+        w->weight = (int)strtol(sched, &end, 10);
+        if (end == sched || *end || w->weight < 1 || w->weight > 100)
+            goto bad;
+    }
+    parse_traffic(model, &w->traffic);
+    if (size)
+        parse_pkt_sizes(size, &w->sizes);
+    nflow++;
+    return;
+
+bad:
+    printf("Bad flow %s (<weight 1~100>|p<level 0~9>/<traffic>[/<pkt-size>])\n", arg);
+    exit(0);
+}
+
+/* "<s>[,<s>...]", a window may be written "10s" as the meter prints it */
+static void parse_meter(char *arg)
+{
+    char *p = arg;
+
+    for (meter_nwin = 0; meter_nwin < METER_WINDOWS; p++) {
+        meter_windows[meter_nwin] = (int)strtol(p, &p, 10);
+        if (meter_windows[meter_nwin] < 1 || meter_windows[meter_nwin] > METER_SECONDS - 4)
+            break;
+        meter_nwin++;
+        if (*p == 's')
+            p++;
+        if (*p == 0)
+            return;
+        if (*p != ',')
+            break;
+    }
+    printf("Bad meter windows %s (up to %d of 1~%d seconds)\n", arg, METER_WINDOWS, METER_SECONDS - 4);
+    exit(0);
+}
+
+static int pkt_sizes_mean(struct PKT_SIZES *z)
+{
+    if (z->dist == SIZE_BIMODAL)
+        return (z->min * z->pct + z->max * (100 - z->pct)) / 100;
+    return (z->min + z->max) / 2;
+}
+
+/* "p<level>" or "w<weight>" */
+static char *flow_name(int f)
+{
+    static THREAD_LOCAL char name[8];
+
+    sprintf(name, flows[f].prio >= 0 ? "p%d" : "w%d", flows[f].prio >= 0 ? flows[f].prio : flows[f].weight);
+    return name;
+}
+
+static void flow_print(void)
+{
+    struct FLOW *w;
+    char rate[32];
+    int i;
+
+    for (i = 0; i < nflow; i++) {
+        w = &flows[i];
+        sprintf(rate, w->traffic.model == TRAFFIC_BACKLOG ? "" : " %.1f pps", w->traffic.pps);
+        lprintf("Flow %d: %s, %s%s, packets of %d~%d bytes\n", i, flow_name(i), 
+            traffic_names[w->traffic.model], rate, w->sizes.min, w->sizes.max);
+    }
+}
 
 static void config(int argc, char **argv)
 {
@@ -143,21 +675,62 @@ static void config(int argc, char **argv)
 		printf(
 			"\nOptions : \n"
 			"    -?, --help : print this\n"
-			"    -u, --utopia : utopia channel (an error-free channel)\n"
 			"    -f, --flood : flood traffic\n"
 			"    -i, --ibib  : set station B layer 3 sender mode as IDLE-BUSY-IDLE-BUSY-...\n"
 			"    -n, --nolog : do not create log file\n"
 			"    -d, --debug=<0-7>: debug mask (bit0:event, bit1:frame, bit2:warning)\n"
 			"    -p, --port=<port#> : TCP port number (default: %u)\n"
-			"    -b, --ber=<ber> : Bit Error Rate (received data only)\n"
 			"    -l, --log=<filename> : using assigned file as log file\n"
 			"    -t, --ttl=<seconds> : set time-to-live\n"
+			"    -x, --chanemu : connect to channel emulator 'chanemu' on the TCP port\n"
+			"    --sq-max=<KB> : max. capacity of physical layer sending queue (default: %d)\n"
+			"    --sq-high=<KB> : high-water mark of sending queue (default: %d)\n"
+			"    --canary : check memory by magic words instead of guard pages\n"
+			"        (either protects the library state, not its heap buffers)\n"
+			"    --connect-timeout=<seconds> : give up connecting the peer (default: %d)\n"
+			"    --links=<n> : bond n physical channels into one link (1~%d, default: 1)\n"
+			"    --fleet=<pairs> : run station pairs in this process over in-memory channels,\n"
+			"        no station name is given (1~%d)\n"
+			"    --workers=<n> : worker threads of the fleet (default: one per CPU)\n"
+			"    --relay=<port#> : relay station, station B on the TCP port and station A\n"
+			"        of the next hop on <port#>, no station name is given\n"
+			"    --relay-queue=<packets> : packets a relay holds for a hop (default: %d)\n"
+			"    --framing=<nibble|cobs> : wire format of frames, COBS halves the bytes\n"
+			"        carried by TCP (default: nibble)\n"
+			"    --pkt-size=<len>|<min>-<max>|<small>,<large>[,<small%%>] : packet lengths,\n"
+			"        fixed, uniform or bimodal (%d~%d, default: %d)\n"
+			"    --traffic=<model> : offered load instead of -f and the busy/idle cycle,\n"
+			"        cbr:<pps>, poisson:<pps>, onoff:<pps>,<on-ms>,<off-ms>[,<shape>]\n"
+			"        (Pareto periods, shape default 1.5) or backlog (always a packet)\n"
+			"    --traffic-queue=<packets> : generated packets waiting for the datalink,\n"
+			"        more are dropped (default: %d)\n"
+			"    --send=<filename> : send the file instead of generated data, '-' for stdin (regular files only on Windows)\n"
+			"    --recv=<filename> : write the file sent by the peer\n"
+			"    --meter=<s>[,<s>...] : windows of the goodput meter, up to %d of 1~%d s\n"
+			"        (default: 1,10,60)\n"
+			"    --flow=<weight>|p<level>/<traffic>[/<pkt-size>] : a flow of packets\n"
+			"        instead of --traffic, up to %d. Levels of strict priority go first,\n"
+			"        p0 first of all, weights 1~100 share the rest. <traffic> and\n"
+			"        <pkt-size> as above, --pkt-size by default.\n"
+			"    --bulk=<packets> : station A sends the packets as fast as it can, both\n"
+			"        stations quit with the completion time when station B has them all\n"
+			CHANNEL_USAGE
+			"\n"
+			"    Channel options given to station A are used by both stations.\n"
+			"    A relay gives the channel options of its next hop.\n"
+			"    With --chanemu, the channel options given to chanemu are used,\n"
+			"    and both stations need the same --pkt-size, --flow and --bulk.\n"
+			"    chanemu imposes the bit errors and reports them in its own log.\n"
 			"\n"
 			"i.e.\n"
 			"    %s -fd3 -b 1e-4 A\n"
 			"    %s --flood --debug=3 --ber=1e-4 A\n"
+			"    %s --flood --bps-ab=64000 --bps-ba=4000 A\n"
+			"    %s --flood --utopia --ttl=60 --fleet=1000\n"
+			"    %s -f -p 6001 A;  %s -p 6001 --relay=6002;  %s -f -p 6002 B\n"
 			"\n",
-			DEFAULT_PORT, argv[0], argv[0]);
+			DEFAULT_PORT, DEFAULT_SQ_MAX / 1024, DEFAULT_SQ_HIGH / 1024, DEFAULT_CONNECT_TIMEOUT, MAX_LINKS,
+			MAX_FLEET, DEFAULT_RELAY_QUEUE, MIN_PKT_LEN, MAX_PKT_LEN, PKT_LEN, DEFAULT_TRAFFIC_QUEUE, METER_WINDOWS, METER_SECONDS - 4, MAX_FLOWS, argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
 		exit(0);
 	}
 
@@ -175,10 +748,6 @@ static void config(int argc, char **argv)
 		case '?':
 			goto usage;
 
-		case 'u':
-			ber = 0.0;
-			break;
-
 		case 'f':
 			mode_flood = 1;
 			break;
@@ -187,6 +756,10 @@ static void config(int argc, char **argv)
 			mode_ibib = 1;
 			break;
 
+		case 'x':
+			mode_proxy = 1;
+			break;
+
 		case 'n':
 			strcpy(fname, "nul");
 			break;
@@ -199,11 +772,119 @@ static void config(int argc, char **argv)
 			port = (unsigned short)atoi(optarg);
 			break;
 
-		case 'b':
-			ber = strtod(optarg, 0);
-			if (ber >= 1.0) {
-				printf("Bad BER %.3f\n", ber);
-				goto usage;
+		case OPT_SCHEDULE:
+			schedule_file = optarg;
+			chan_assigned = 1;
+			break;
+
+		case OPT_SQ_MAX:
+			sq_max = atoi(optarg) * 1024;
+			break;
+
+		case OPT_SQ_HIGH:
+			sq_high = atoi(optarg) * 1024;
+			break;
+
+		case OPT_CANARY:
+			mode_canary = 1;
+			break;
+
+		case OPT_CONNECT_TIMEOUT:
+			connect_timeout = atoi(optarg);
+			if (connect_timeout <= 0) {
+				printf("Bad connect timeout %s seconds\n", optarg);
+				exit(0);
+			}
+			break;
+
+		case OPT_LINKS:
+			nlink = atoi(optarg);
+			if (nlink < 1 || nlink > MAX_LINKS) {
+				printf("Bad number of links %s (1~%d)\n", optarg, MAX_LINKS);
+				exit(0);
+			}
+			nlink_assigned = 1;
+			break;
+
+		case OPT_FLEET:
+			fleet_pairs = atoi(optarg);
+			if (fleet_pairs < 1 || fleet_pairs > MAX_FLEET) {
+				printf("Bad number of station pairs %s (1~%d)\n", optarg, MAX_FLEET);
+				exit(0);
+			}
+			break;
+
+		case OPT_WORKERS:
+			fleet_workers = atoi(optarg);
+			if (fleet_workers < 1) {
+				printf("Bad number of workers %s\n", optarg);
+				exit(0);
+			}
+			break;
+
+		case OPT_RELAY:
+			relay_port = (unsigned short)atoi(optarg);
+			break;
+
+		case OPT_RELAY_QUEUE:
+			relay_queue = atoi(optarg);
+			if (relay_queue < 1) {
+				printf("Bad relay queue size %s packets\n", optarg);
+				exit(0);
+			}
+			break;
+
+		case OPT_FRAMING:
+			if (stricmp(optarg, "nibble") == 0)
+				framing = FRAMING_NIBBLE;
+			else if (stricmp(optarg, "cobs") == 0)
+				framing = FRAMING_COBS;
+			else {
+				printf("Bad framing %s (nibble or cobs)\n", optarg);
+				exit(0);
+			}
+			framing_assigned = 1;
+			break;
+
+		case OPT_PKT_SIZE:
+			parse_pkt_sizes(optarg, &pkt_sizes);
+			pkt_sizes_assigned = 1;
+			break;
+
+		case OPT_TRAFFIC:
+			parse_traffic(optarg, &traffic);
+			break;
+
+		case OPT_FLOW:
+			parse_flow(optarg);
+			break;
+
+		case OPT_BULK:
+			bulk_packets = atoi(optarg);
+			if (bulk_packets < 1) {
+				printf("Bad bulk transfer %s packets\n", optarg);
+				exit(0);
+			}
+			bulk_assigned = 1;
+			break;
+
+		case OPT_SEND:
+			send_file = optarg;
+			break;
+
+		case OPT_RECV:
+			recv_file = optarg;
+			break;
+
+		case OPT_METER:
+			parse_meter(optarg);
+			break;
+
+		case OPT_TRAFFIC_QUEUE:
+			traffic_queue = atoi(optarg);
+			if (traffic_queue < 1) {
+				printf("Bad traffic queue size %s packets\n", optarg);
+				exit(0);
 			}
 			break;
 
@@ -216,23 +897,91 @@ static void config(int argc, char **argv)
 			break;
 
 		default:
+			if (channel_option(opt, optarg, chan)) {
+				chan_assigned = 1;
+				break;
+			}
 			printf("ERROR: Unsupported option\n");
 			goto usage;
 		}
 	}
 
-	if (optind == argc) 
+	if (optind == argc && !fleet_pairs && !relay_port) 
 		goto usage;
 
-	station = tolower(argv[optind++][0]);
-	if (station != 'a' && station != 'b')
-		ABORT("Station name must be 'A' or 'B'");
+	if (mode_proxy && nlink > 1) {
+		printf("chanemu emulates a single channel, --links is not supported\n");
+		exit(0);
+	}
+
+	if (mode_proxy && fleet_pairs) {
+		printf("The fleet runs its channels in memory, --chanemu is not supported\n");
+		exit(0);
+	}
+
+	if (mode_proxy && framing != FRAMING_NIBBLE) {
+		printf("chanemu carries nibble-encoded frames, --framing is not supported\n");
+		exit(0);
+	}
+
+	if ((send_file || recv_file) && (fleet_pairs || relay_port)) {
+		printf("--send and --recv are for one station, not --fleet or --relay\n");
+		exit(0);
+	}
+
+	if (bulk_packets && (fleet_pairs || relay_port)) {
+		printf("--bulk is for one station, not --fleet or --relay\n");
+		exit(0);
+	}
+
+	if (bulk_packets && (nflow || traffic.model != TRAFFIC_LEGACY || send_file)) {
+		printf("--bulk is instead of --flow, --traffic and --send\n");
+		exit(0);
+	}
+
+	if (bulk_packets && pkt_sizes.max < FILE_HDR + (int)sizeof(struct BULK_SUMMARY)) {
+		printf("--bulk needs packets of %d bytes at least\n", FILE_HDR + (int)sizeof(struct BULK_SUMMARY));
+		exit(0);
+	}
+
+	if (send_file && pkt_sizes.max < FILE_HDR + 16) {
+		printf("--send needs packets of %d bytes at least\n", FILE_HDR + 16);
+		exit(0);
+	}
+
+	if (nflow && (traffic.model != TRAFFIC_LEGACY || send_file)) {
+		printf("--flow is instead of --traffic and --send\n");
+		exit(0);
+	}
+	for (i = 0; i < nflow; i++) {
+		if (flows[i].sizes.min == 0)
+			flows[i].sizes = pkt_sizes;
+	}
+
+	if (relay_port && (mode_proxy || fleet_pairs || relay_port == port)) {
+		printf("A relay needs a TCP port of its own, and no --chanemu or --fleet\n");
+		exit(0);
+	}
+
+	if (sq_max < 4 * 1024 || sq_high <= 0 || sq_high >= sq_max) {
+		printf("Bad sending queue size %d KB or high-water mark %d KB\n", sq_max / 1024, sq_high / 1024);
+		exit(0);
+	}
+
+	if (!fleet_pairs && !relay_port) {
+		ps->station = tolower(argv[optind++][0]);
+		if (ps->station != 'a' && ps->station != 'b')
+			ABORT("Station name must be 'A' or 'B'");
+	}
 
 	if (fname[0] == 0) {
 		strcpy(fname, argv[0]);
 		if (stricmp(fname + strlen(fname) - 4, ".exe") == 0)
 			*(fname + strlen(fname) - 4) = 0;
-		strcat(fname, station == 'a' ? "-A.log" : "-B.log");
+		if (relay_port)
+			sprintf(fname + strlen(fname), "-relay-%u.log", relay_port);
+		else
+			strcat(fname, fleet_pairs ? "-fleet.log" : ps->station == 'a' ? "-A.log" : "-B.log");
 	}
 
 	if (stricmp(fname, "nul") == 0)
@@ -242,287 +991,990 @@ static void config(int argc, char **argv)
 
 	lprintf(
 		"=============================================================\n"
-		"                    Station %s                               \n"
+		"                    %s %s                               \n"
 		"-------------------------------------------------------------\n",
-		station_name());
+		fleet_pairs ? "Fleet" : relay_port ? "Relay" : "Station", fleet_pairs || relay_port ? "" : station_name());
 
 	lprintf("Protocol.lib, version %s, jiangyanjun0718@bupt.edu.cn\n", VERSION, __DATE__);
-	lprintf("Channel: %d bps, %d ms propagation delay, bit error rate ", CHAN_BPS, CHAN_DELAY);
-	if (ber > 0.0)
-		lprintf("%.1E\n", ber);
-	else
-		lprintf("0\n");
 	lprintf("Log file \"%s\", TCP port %d, debug mask 0x%02x\n", fname, port, debug_mask);
+
+	if (schedule_file) {
+		nphase = load_schedule(schedule_file, chan, &phases);
+		lprintf("Channel schedule \"%s\", %d phases, last one begins at %d.%03d s\n", schedule_file, 
+			nphase, phases[nphase - 1].start / 1000, phases[nphase - 1].start % 1000);
+	}
 }
 
-/* Create Communication Sockets  */
+/* Link Setup Handshake */
 
-void protocol_init(int argc, char **argv)
+static void hs_send(int sock, void *buf, int len)
 {
-    int admin_sock, i;
-    struct sockaddr_in name;
+    int n;
 
-	socket_init();
-	magic_init();
+    for (; len > 0; len -= n, buf = (char *)buf + n) {
+        n = send(sock, (char *)buf, len, 0);
+        if (n <= 0)
+            ABORT("Link setup handshake failed (send)");
+    }
+}
 
-	config(argc, argv);
-  
-    if (station == 'a') {
+static void hs_recv(int sock, void *buf, int len)
+{
+    int n;
 
-        srand(mode_seed ^ 97209);
+    for (; len > 0; len -= n, buf = (char *)buf + n) {
+        n = recv(sock, (char *)buf, len, 0);
+        if (n <= 0)
+            ABORT("Link setup handshake failed (recv)");
+    }
+}
 
-        name.sin_family = AF_INET;
-        name.sin_addr.s_addr = INADDR_ANY;
-        name.sin_port = htons(port);
+/* adopt channel parameters and schedule dictated by the peer */
+static void recv_channel(int sock, char *peer)
+{
+    struct CHANNEL mine[2];
+    int mine_nphase = nphase;
+
+    memcpy(mine, chan, sizeof(chan));
+    hs_recv(sock, chan, sizeof(chan));
+    if (chan_assigned && (memcmp(mine, chan, sizeof(chan)) != 0 || mine_nphase))
+        lprintf("WARNING: Channel options of station %s are overridden by %s\n", station_name(), peer);
+
+    free(phases);
+    phases = NULL;
+    hs_recv(sock, &nphase, sizeof(nphase));
+    if (nphase) {
+        phases = (struct PHASE *)malloc(nphase * sizeof(struct PHASE));
+        if (phases == NULL)
+            ABORT("No enough memory");
+        hs_recv(sock, phases, nphase * sizeof(struct PHASE));
+        lprintf("Channel schedule of %s, %d phases\n", peer, nphase);
+    }
+}
+
+/* 
+    Station B proposes the epoch, station A dictates the channel parameters.
+    A relay has the epoch of its first hop already, station A echoes the 
+    epoch in effect, so a whole chain shares one. Both tell whether they 
+    are a relay, station A dictates the framing and the packet sizes. With 
+    chanemu, both stations announce themselves and chanemu dictates both.
+*/
+static void handshake(int sock)
+{
+    int relay = relay_port != 0;
+
+    if (mode_proxy) {
+        char name = (char)ps->station;
+
+        hs_send(sock, &name, 1);
+        hs_recv(sock, &epoch, sizeof(epoch));
+        recv_channel(sock, "chanemu");
+    } else if (ps->station == 'a') {
+        time_t proposed;
+
+        hs_recv(sock, &proposed, sizeof(proposed));
+        hs_recv(sock, &ps->peer_relay, sizeof(ps->peer_relay));
+        if (epoch == 0)
+            epoch = proposed;
+        hs_send(sock, chan, sizeof(chan));
+        hs_send(sock, &nphase, sizeof(nphase));
+        if (nphase)
+            hs_send(sock, phases, nphase * sizeof(struct PHASE));
+        hs_send(sock, &nlink, sizeof(nlink));
+        hs_send(sock, &epoch, sizeof(epoch));
+        hs_send(sock, &relay, sizeof(relay));
+        hs_send(sock, &ps->framing, sizeof(ps->framing));
+        hs_send(sock, &ps->sizes, sizeof(ps->sizes));
+        hs_send(sock, &nflow, sizeof(nflow));
+        hs_send(sock, flows, nflow * sizeof(struct FLOW));
+        hs_send(sock, &bulk_packets, sizeof(bulk_packets));
+    } else {
+        int mine = nlink, i;
+        struct FLOW mine_flows[MAX_FLOWS];
+        int mine_nflow = nflow, mine_bulk = bulk_packets;
 
-        admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (admin_sock < 0) 
-            ABORT("Create TCP socket");
-        if (bind(admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
-            lprintf("Station A: Failed to bind TCP port %u", port);
-            ABORT("Station A failed to bind TCP port");
+        time(&epoch);
+        hs_send(sock, &epoch, sizeof(epoch));
+        hs_send(sock, &relay, sizeof(relay));
+        recv_channel(sock, "station A");
+        hs_recv(sock, &nlink, sizeof(nlink));
+        if (nlink < 1 || nlink > MAX_LINKS)
+            ABORT("Link setup handshake failed (links)");
+        if (nlink_assigned && nlink != mine)
+            lprintf("WARNING: --links of station B is overridden by station A\n");
+        hs_recv(sock, &epoch, sizeof(epoch));
+        hs_recv(sock, &ps->peer_relay, sizeof(ps->peer_relay));
+        hs_recv(sock, &ps->framing, sizeof(ps->framing));
+        if (ps->framing != FRAMING_NIBBLE && ps->framing != FRAMING_COBS)
+            ABORT("Link setup handshake failed (framing)");
+        if (framing_assigned && ps->framing != framing)
+            lprintf("WARNING: --framing of station B is overridden by station A\n");
+        hs_recv(sock, &ps->sizes, sizeof(ps->sizes));
+        if (ps->sizes.dist < SIZE_FIXED || ps->sizes.dist > SIZE_BIMODAL || ps->sizes.min < MIN_PKT_LEN 
+            || ps->sizes.max > MAX_PKT_LEN || ps->sizes.min > ps->sizes.max)
+            ABORT("Link setup handshake failed (packet size)");
+        if (pkt_sizes_assigned && memcmp(&ps->sizes, &pkt_sizes, sizeof(pkt_sizes)) != 0)
+            lprintf("WARNING: --pkt-size of station B is overridden by station A\n");
+        memcpy(mine_flows, flows, sizeof(flows));
+        hs_recv(sock, &nflow, sizeof(nflow));
+        if (nflow < 0 || nflow > MAX_FLOWS)
+            ABORT("Link setup handshake failed (flows)");
+        hs_recv(sock, flows, nflow * sizeof(struct FLOW));
+        for (i = 0; i < nflow; i++) {
+            if (flows[i].traffic.model <= TRAFFIC_LEGACY || flows[i].traffic.model > TRAFFIC_BACKLOG 
+                || flows[i].prio > 9 || (flows[i].prio < 0 && (flows[i].weight < 1 || flows[i].weight > 100))
+                || flows[i].sizes.dist < SIZE_FIXED || flows[i].sizes.dist > SIZE_BIMODAL 
+                || flows[i].sizes.min < MIN_PKT_LEN || flows[i].sizes.max > MAX_PKT_LEN || flows[i].sizes.min > flows[i].sizes.max)
+                ABORT("Link setup handshake failed (flows)");
         }
+        if (mine_nflow && (mine_nflow != nflow || memcmp(mine_flows, flows, nflow * sizeof(struct FLOW)) != 0))
+            lprintf("WARNING: --flow of station B is overridden by station A\n");
+        hs_recv(sock, &bulk_packets, sizeof(bulk_packets));
+        if (bulk_packets < 0)
+            ABORT("Link setup handshake failed (bulk)");
+        if (bulk_assigned && bulk_packets != mine_bulk)
+            lprintf("WARNING: --bulk of station B is overridden by station A\n");
+    }
 
-        listen(admin_sock, 5);
+    print_channel("A->B", &chan[CHAN_AB]);
+    print_channel("B->A", &chan[CHAN_BA]);
+    if (ps->framing == FRAMING_COBS)
+        lprintf("COBS framing\n");
+    if (ps->sizes.dist == SIZE_UNIFORM)
+        lprintf("Packets of %d~%d bytes\n", ps->sizes.min, ps->sizes.max);
+    else if (ps->sizes.dist == SIZE_BIMODAL)
+        lprintf("Packets of %d bytes (%d%%) or %d bytes\n", ps->sizes.min, ps->sizes.pct, ps->sizes.max);
+    else if (ps->sizes.min != PKT_LEN)
+        lprintf("Packets of %d bytes\n", ps->sizes.min);
+    flow_print();
+    if (bulk_packets)
+        lprintf("Bulk transfer of %d packets\n", bulk_packets);
+}
 
-        lprintf("Station A is waiting for station B on TCP port %u ... ", port);
-        fflush(stdout);
+/* the instance works on its own copy, the schedule changes it */
+static void channel_init(void)
+{
+    memcpy(ps->chan, chan, sizeof(chan));
+    ps->phases = phases;
+    ps->nphase = nphase;
+    ps->tx_chan = &ps->chan[ps->station == 'a' ? CHAN_AB : CHAN_BA];
+    ps->rx_chan = &ps->chan[ps->station == 'a' ? CHAN_BA : CHAN_AB];
+}
 
-        sock = accept(admin_sock, 0, 0);
-        if (sock < 0) 
-            ABORT("Station A failed to communicate with station B");
-        lprintf("Done.\n");
+/* Create Communication Sockets  */
 
-        recv(sock, (char *)&epoch, sizeof(epoch), 0);
+static void link_listen(void)
+{
+    struct sockaddr_in name;
+    int on = 1;
+
+    name.sin_family = AF_INET;
+    name.sin_addr.s_addr = INADDR_ANY;
+    name.sin_port = htons(ps->port);
+
+    ps->admin_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (ps->admin_sock < 0) 
+        ABORT("Create TCP socket");
+    /* rebind at once when runs are started back to back */
+    setsockopt(ps->admin_sock, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+    if (bind(ps->admin_sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
+        lprintf("Station A: Failed to bind TCP port %u", ps->port);
+        ABORT("Station A failed to bind TCP port");
     }
 
-    if (station == 'b') {
+    listen(ps->admin_sock, 5);
+}
+
+/* 
+    'timeout' (seconds) bounds the wait for the peer. Once the run has begun 
+    (the epoch is agreed), a resume that outlasts it quits the station: the 
+    peer may have quit for good at the end of the run.
+*/
+static int link_connect(int timeout)
+{
+    struct sockaddr_in name;
+    int sock;
 
-        srand(mode_seed ^ 18231);
+    if (ps->station == 'a' && !mode_proxy) {
+        fd_set rfd;
+        struct timeval tm;
+        int ms = timeout * 1000;
+
+        lprintf("Station A is waiting for station B on TCP port %u ... ", ps->port);
+        fflush(stdout);
+
+        if (epoch && mode_life - (int)get_ms() < ms)
+            ms = mode_life - (int)get_ms() > 0 ? mode_life - (int)get_ms() : 0;
+        tm.tv_sec = ms / 1000;
+        tm.tv_usec = ms % 1000 * 1000;
+        FD_ZERO(&rfd);
+        FD_SET(ps->admin_sock, &rfd);
+        if (select(ps->admin_sock + 1, &rfd, 0, 0, &tm) <= 0) {
+            lprintf("Failed!\n");
+            if (epoch && (int)get_ms() >= mode_life)
+                station_quit();
+            lprintf("Station B did not connect in %d seconds\n", timeout);
+            ABORT(epoch ? "Station B did not come back" : "Station B did not come");
+        }
 
-        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        sock = accept(ps->admin_sock, 0, 0);
         if (sock < 0) 
-            ABORT("Create TCP socket");
+            ABORT("Station A failed to communicate with station B");
+        lprintf("Done.\n");
+    } else {
+        char *peer = mode_proxy ? "chanemu" : "station A";
+        unsigned int ms0 = wall_ms(); /* connect() may block, time it too */
+        int backoff;
 
         name.sin_family = AF_INET;
         name.sin_addr.s_addr = inet_addr("127.0.0.1");
-        name.sin_port = htons((short)port);
+        name.sin_port = htons((short)ps->port);
+
+        lprintf("Station %s is connecting %s (TCP port %u) ... ", station_name(), peer, ps->port);
+        fflush(stdout);
 
-        for (i = 0; i < 60; i++) {
-            lprintf("Station B is connecting station A (TCP port %u) ... ", port);
-            fflush(stdout);
+        /* the peer may not listen yet: retry with exponential backoff from 100us */
+        for (backoff = CONNECT_BACKOFF_MIN; ; ) {
+            sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            if (sock < 0) 
+                ABORT("Create TCP socket");
 
-            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) < 0) {
-                lprintf("Failed!\n");
-                Sleep(2000);
-            } else {
-                lprintf("Done.\n");
+            if (connect(sock, (struct sockaddr *)&name, sizeof(struct sockaddr_in)) == 0) 
                 break;
-            }
-        }
-        if (i == 6)
-            ABORT("Station B failed to connect station A");
+            closesocket(sock);
 
-        time(&epoch);
-        send(sock, (char *)&epoch, sizeof(epoch), 0);
-    }
+            if (epoch && (int)get_ms() >= mode_life) {
+                lprintf("Failed!\n");
+                station_quit();
+            }
+            if (wall_ms() - ms0 >= (unsigned int)timeout * 1000) {
+                lprintf("Failed!\n");
+                lprintf("Station %s failed to connect %s in %d seconds\n", station_name(), peer, timeout);
+                ABORT("Failed to connect TCP port");
+            }
 
-    {
-        struct tm *newtime;
-        newtime = localtime(&epoch);
-        lprintf("New epoch: %s", asctime(newtime));
-        lprintf("=================================================================\n\n");
+            sleep_us(backoff);
+            if (backoff < CONNECT_BACKOFF_MAX)
+                backoff *= 2;
+        }
+        lprintf("Done (%d ms).\n", (int)(wall_ms() - ms0));
     }
 
-    /* socket options */
-    {
-        int timeout_ms = 10; 
-        int buf_size = 1024 * 64;
-        int on = 1;
-
-        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout_ms, sizeof(int));
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout_ms, sizeof(int));
-
-        setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
-        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
-
-        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
-    }   
-
-    get_ms();
+    return sock;
 }
 
-/* Physical Layer: Sender */
-
-/* Sending queue structure */
-
-#define SQ_SIZE (128 * 1024) 
+/* 
+    The data path never blocks: a byte the socket does not take now waits in the 
+    sending queue. The buffers hold two of the longest frames on the wire.
+*/
+static void socket_options(int sock)
+{
+    int buf_size = 4 * (pkt_len_max() + FRAME_SLACK);
+    int on = 1;
 
-static unsigned char sq[SQ_SIZE];
-static int sq_head, sq_tail;
-static int inform_phl_ready = 1;
+    if (buf_size < 1024 * 64)
+        buf_size = 1024 * 64;
+    sock_nonblock(sock);
 
-#define sq_inc(p, n) (p = (p + n) % SQ_SIZE)
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&buf_size, sizeof(int));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (char *)&buf_size, sizeof(int));
 
-static int send_bytes_allowed = 0;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));   
+}
 
-static int sq_len(void)
+/* 
+    Link Attachment
+
+    Every link but the first, and every link after its TCP connection 
+    broke, is attached to the session this way: station B connects and 
+    tells the epoch, the link No. and the bytes it has received on the 
+    link; station A answers with the epoch and its own count. Each side 
+    then replays the bytes lost in flight from its replay ring, so the 
+    byte stream of the link goes on seamlessly. The replay goes out 
+    ahead of the sending queue as the socket takes it, while the replay 
+    of the peer is read: both sides replaying at once cannot deadlock.
+*/
+
+/* return the bytes to replay */
+static unsigned int link_replay(struct PHL *l, unsigned int peer_rx_bytes)
 {
-    return (sq_tail + SQ_SIZE - sq_head) % SQ_SIZE;
+    unsigned int lost = l->tx_bytes - peer_rx_bytes;
+
+    if (lost > RP_SIZE) 
+        ABORT("Too many bytes lost in flight to resume the session");
+    socket_options(l->sock);
+    l->rp_next = peer_rx_bytes;
+    l->rp_end = l->tx_bytes;
+    return lost;
 }
 
-int phl_sq_len(void)
+/* return 1 when the replay is done */
+static int replay_send(struct PHL *l)
 {
-    return sq_len();
+    int n, start;
+
+    while (l->rp_next != l->rp_end) {
+        start = l->rp_next % RP_SIZE;
+        n = l->rp_end - l->rp_next < (unsigned int)(RP_SIZE - start) ? (int)(l->rp_end - l->rp_next) : RP_SIZE - start;
+        n = send(l->sock, (char *)l->rp + start, n, 0);
+        if (n < 0 && sock_again())
+            return 0;
+        if (n <= 0) {
+            session_resume(l);
+            return 0;
+        }
+        l->rp_next += n;
+    }
+    return 1;
 }
 
-static void send_byte(unsigned char byte)
+/* station B */
+static unsigned int link_join(struct PHL *l)
 {
-    inform_phl_ready = 1;
+    int nr = (int)(l - ps->link);
+    time_t peer_epoch;
+    unsigned int peer_rx_bytes;
 
-    if (send_bytes_allowed && sq_head == sq_tail) {
-        send(sock, (char *)&byte, 1, 0);
-        send_bytes_allowed--;
-        return;
-    }
+    l->sock = link_connect(connect_timeout);
 
-    if (sq_len() == SQ_SIZE - 1)
-        ABORT("Physical Layer Sending Queue overflow");
+    hs_send(l->sock, &epoch, sizeof(epoch));
+    hs_send(l->sock, &nr, sizeof(nr));
+    hs_send(l->sock, &l->rx_bytes, sizeof(l->rx_bytes));
+    hs_recv(l->sock, &peer_epoch, sizeof(peer_epoch));
+    if (peer_epoch != epoch) 
+        ABORT("The peer station has started a new session");
+    hs_recv(l->sock, &peer_rx_bytes, sizeof(peer_rx_bytes));
 
-    sq[sq_tail] = byte;
-    sq_inc(sq_tail, 1);
+    return link_replay(l, peer_rx_bytes);
 }
 
-void send_frame(unsigned char *frame, int len)
+/* station A, return the link attached by station B */
+static struct PHL *link_accept(unsigned int *replayed)
 {
-    int i;
-
-    send_byte(0xff);
-    
-    for (i = 0; i < len; i++) {
-        send_byte(frame[i] & 0x0f);
-        send_byte((frame[i] & 0xf0) >> 4);
-    }
-    send_byte(0xff);
+    int sock, nr;
+    time_t peer_epoch;
+    unsigned int peer_rx_bytes;
+    struct PHL *l;
+
+    sock = link_connect(connect_timeout);
+
+    hs_recv(sock, &peer_epoch, sizeof(peer_epoch));
+    if (peer_epoch != epoch) 
+        ABORT("The peer station has started a new session");
+    hs_recv(sock, &nr, sizeof(nr));
+    if (nr < 0 || nr >= nlink)
+        ABORT("Link setup handshake failed (link No.)");
+    hs_recv(sock, &peer_rx_bytes, sizeof(peer_rx_bytes));
+
+    /* station B has given up the old connection of the link */
+    l = &ps->link[nr];
+    if (l->sock >= 0)
+        closesocket(l->sock);
+    l->sock = sock;
+
+    hs_send(sock, &epoch, sizeof(epoch));
+    hs_send(sock, &l->rx_bytes, sizeof(l->rx_bytes));
+
+    *replayed = link_replay(l, peer_rx_bytes);
+    return l;
 }
 
-static int send_sq_data(unsigned int start, unsigned int end1)
+/* connect the peer of station 'ps' and set up its links */
+static void station_setup(void)
 {
-    int ret;
+    int i;
+    unsigned int replayed;
 
-    if (start >= end1) 
-        return 0;
+    if (ps->station == 'a' && !mode_proxy) 
+        link_listen();
+    ps->link[0].sock = link_connect(connect_timeout);
 
-    ret = send(sock, (char *)&sq[start], end1 - start, 0);
-    if (ret <= 0) {
-        lprintf("TCP Disconnected.\n");
+    handshake(ps->link[0].sock);
+    channel_init();
+
+    {
+        struct tm *newtime;
+        newtime = localtime(&epoch);
+        lprintf("New epoch: %s", asctime(newtime));
+        lprintf("=================================================================\n\n");
+    }
+
+    sq_init();
+    socket_options(ps->link[0].sock);
+
+    for (i = 1; i < nlink; i++) {
+        if (ps->station == 'a')
+            link_accept(&replayed);
+        else
+            link_join(&ps->link[i]);
+    }
+    if (nlink > 1)
+        lprintf("%d physical channels bonded\n", nlink);
+}
+
+void protocol_init(int argc, char **argv)
+{
+	/* an instance hosted by fleet_run() or relay_run(), set up already */
+	if (cur_inst)
+		return;
+
+	socket_init();
+	crc32_setup();
+
+	config(argc, argv);
+	if (fleet_pairs)
+		fleet_run(argc, argv); /* never returns */
+	if (relay_port)
+		relay_run(argc, argv); /* never returns */
+	state_init();
+
+    srand(mode_seed ^ (ps->station == 'a' ? 97209 : 18231));
+    ps->rand_seed = mode_seed ^ (ps->station == 'a' ? 97209 : 18231);
+    file_open();
+    station_setup();
+
+    get_ms();
+}
+
+/* 
+    Session Resume
+
+    When the TCP connection of a link breaks, station B attaches the link 
+    again. Sending queue, receiving blocks and timers are kept. chanemu 
+    keeps no session, a broken link to it is still fatal.
+*/
+static void session_resume(struct PHL *l)
+{
+    unsigned int replayed;
+    int ms0 = get_ms();
+
+    closesocket(l->sock);
+    l->sock = -1;
+    if (ps->bulk_state == BULK_SENT) {
+        lprintf("TCP disconnected, station A has the report.\n");
+        station_quit();
+    }
+    if (mode_proxy) {
+        lprintf("TCP disconnected.\n");
         exit(0);
     }
+    lprintf("TCP disconnected (link %d), resuming session ...\n", (int)(l - ps->link));
+
+    if (ps->station == 'b')
+        replayed = link_join(l);
+    else {
+        while (link_accept(&replayed) != l)
+            ;
+    }
+
+    /* the outage is not credited to the sender */
+    ps->resumes++;
+    now = get_ms();
+    l->send_ts = now;
+    l->send_bytes_frac = 0;
+    lprintf("Session resumed in %d ms, %u bytes replayed\n", now - ms0, replayed);
+}
+
+/* Physical Layer: Sender */
+
+/* Sending queue structure: a ring per link, doubled on demand up to 'sq_max' bytes */
+
+#define SQ_SIZE (128 * 1024) 
+
+#define sq_inc(l, p, n) (p = (p + n) % (l)->sq_size)
+
+
+static int sq_len(struct PHL *l)
+{
+    return (l->sq_tail + l->sq_size - l->sq_head) % l->sq_size;
+}
+
+static int link_sq_len(struct PHL *l)
+{
+    return sq_len(l) + l->vq_len;
+}
+
+int phl_sq_len(void)
+{
+    int i, n = 0;
+
+    for (i = 0; i < nlink; i++) 
+        n += link_sq_len(&ps->link[i]);
+    return n;
+}
+
+/* the shortest queue decides whether another frame can go out */
+static int phl_sq_min(void)
+{
+    int i, n, min = link_sq_len(&ps->link[0]);
+
+    for (i = 1; i < nlink; i++) {
+        n = link_sq_len(&ps->link[i]);
+        if (n < min)
+            min = n;
+    }
+    return min;
+}
+
+/* hand 'len' bytes to TCP and keep them for replay, return the bytes taken */
+static int phl_send(struct PHL *l, unsigned char *buf, int len)
+{
+    int n, i;
+
+    if (ps->peer) {
+        fleet_deliver(l, buf, len);
+        l->tx_bytes += len;
+        return len;
+    }
+
+    n = send(l->sock, (char *)buf, len, 0);
+    if (n < 0 && sock_again())
+        return 0;
+    if (n <= 0) {
+        session_resume(l);
+        return 0;
+    }
+
+    if (l->rp) {
+        i = l->tx_bytes % RP_SIZE;
+        if (i + n <= RP_SIZE)
+            memcpy(l->rp + i, buf, n);
+        else {
+            memcpy(l->rp + i, buf, RP_SIZE - i);
+            memcpy(l->rp, buf + RP_SIZE - i, n - (RP_SIZE - i));
+        }
+    }
+    l->tx_bytes += n;
+    return n;
+}
+
+static void send_byte(struct PHL *l, unsigned char byte)
+{
+    ps->inform_phl_ready = 1;
+
+    /* a fleet instance would deliver a block per byte, its queue is flushed once per tick */
+    if (l->send_bytes_allowed && l->sq_head == l->sq_tail && l->rp_next == l->rp_end && !ps->peer 
+        && phl_send(l, &byte, 1) == 1) {
+        l->send_bytes_allowed--;
+        return;
+    }
+
+    if (sq_len(l) == l->sq_size - 1)
+        ABORT("Physical Layer Sending Queue overflow");
+
+    l->sq[l->sq_tail] = byte;
+    sq_inc(l, l->sq_tail, 1);
+}
+
+static void sq_init(void)
+{
+    int i;
+    struct PHL *l;
+
+    for (i = 0; i < nlink; i++) {
+        l = &ps->link[i];
+        l->sq_size = fleet_pairs ? FLEET_SQ_SIZE : SQ_SIZE < sq_max ? SQ_SIZE : sq_max;
+        l->sq = (unsigned char *)malloc(l->sq_size);
+        if (l->sq == NULL)
+            ABORT("No enough memory");
+
+        if (!mode_proxy && !fleet_pairs) {
+            l->rp = (unsigned char *)malloc(RP_SIZE);
+            if (l->rp == NULL)
+                ABORT("No enough memory");
+        }
+    }
+}
+
+/* make room for 'n' more bytes, return 0 if 'sq_max' would be exceeded */
+static int sq_reserve(struct PHL *l, int n)
+{
+    unsigned char *buf;
+    int size, len = sq_len(l);
+
+    for (size = l->sq_size; len + n > size - 1; size *= 2)
+        ;
+    if (size == l->sq_size)
+        return 1;
+    if (size > sq_max) {
+        if (len + n > sq_max - 1)
+            return 0;
+        size = sq_max;
+    }
+
+    buf = (unsigned char *)malloc(size);
+    if (buf == NULL)
+        return 0;
+
+    if (l->sq_tail >= l->sq_head)
+        memcpy(buf, l->sq + l->sq_head, len);
+    else {
+        memcpy(buf, l->sq + l->sq_head, l->sq_size - l->sq_head);
+        memcpy(buf + l->sq_size - l->sq_head, l->sq, l->sq_tail);
+    }
+    free(l->sq);
+    l->sq = buf;
+    l->sq_size = size;
+    l->sq_head = 0;
+    l->sq_tail = len;
+
+    if (size > SQ_SIZE)
+        dbg_warning("Physical Layer Sending Queue grows to %d KB\n", size / 1024);
+
+    return 1;
+}
+
+/* 
+    The link which puts the frame on the channel first, round robin among 
+    equals. As the links run at the same rate, frames arrive in the order 
+    they are sent, which keeps the datalink from NAKing reordered frames.
+*/
+static struct PHL *link_pick(void)
+{
+    int i, n, min = -1;
+    struct PHL *l = NULL, *c;
+
+    for (i = 0; i < nlink; i++) {
+        c = &ps->link[(ps->rr + i) % nlink];
+        n = link_sq_len(c);
+        if (min < 0 || n < min) {
+            min = n;
+            l = c;
+        }
+    }
+    ps->rr = (int)(l - ps->link + 1) % nlink;
+    return l;
+}
+
+/* 
+    COBS: a code byte tells the distance to the next zero, which is left 
+    out. A code 0xff stands for 254 non-zero bytes and no zero. The bond 
+    header, the frame and COBS_TAIL are encoded as one. 
+
+    A delimiter hit by noise merges a frame with what follows, which may 
+    decode as the frame plus zeros, and zeros appended to a frame keep its 
+    CRC good. The tail byte gives such a frame away.
+*/
+/* 
+    With 'crc', the CRC of the frame goes between the frame and the tail. 
+    It is taken run by run as the encoder scans the frame, and completed 
+    when the scan reaches it.
+*/
+static void send_cobs(struct PHL *l, unsigned char *hdr, int hlen, unsigned char *frame, int len, 
+    unsigned int *crc)
+{
+    int i, j, k, done = 0, tlen = crc ? 5 : 1, n = hlen + len + tlen;
+    unsigned char trl[5];
+
+#define cobs_at(k) ((k) < hlen ? hdr[k] : (k) - hlen < len ? frame[(k) - hlen] : trl[(k) - hlen - len])
+
+    trl[tlen - 1] = COBS_TAIL;
+    for (i = 0; ; i = j - i == 254 ? j : j + 1) {
+        for (j = i; j < n && j - i < 254; j++) {
+            if (crc && done >= 0 && j == hlen + len) {
+                *crc = crc32_final(crc32_update(*crc, frame + done, len - done));
+                for (k = 0; k < 4; k++)
+                    trl[k] = (unsigned char)(*crc >> (8 * k));
+                done = -1;
+            }
+            if (cobs_at(j) == 0)
+                break;
+        }
+        send_byte(l, (unsigned char)(j - i + 1));
+        for (k = i; k < j; k++)
+            send_byte(l, cobs_at(k));
+        if (j == n)
+            break;
+
+        /* the run and its zero */
+        k = (j < hlen + len ? j + 1 : hlen + len) - hlen;
+        if (crc && done >= 0 && k > done) {
+            *crc = crc32_update(*crc, frame + done, k - done);
+            done = k;
+        }
+    }
+
+#undef cobs_at
+}
+
+/* 
+    Where the datalink program puts the packet in its frames is learned 
+    from the first frame that carries one.
+*/
+static struct SENT_PKT *sent_find(unsigned char *hdr)
+{
+    int i;
+
+    for (i = 0; i < SENT_RING; i++) {
+        if (ps->sent[i].sends && memcmp(ps->sent[i].hdr, hdr, PKT_HDR) == 0)
+            return &ps->sent[i];
+    }
+    return NULL;
+}
 
-    return ret;
+/* return -1 if the frame carries no packet */
+static int frame_pkt_off(unsigned char *frame, int len)
+{
+    int i;
+
+    for (i = 0; ps->pkt_off < 0 && i < PKT_OFF_MAX && i + PKT_HDR <= len; i++) {
+        if (sent_find(frame + i))
+            ps->pkt_off = i;
+    }
+    if (ps->pkt_off < 0 || ps->pkt_off + PKT_HDR > len)
+        return -1;
+    return ps->pkt_off;
 }
 
-static void socket_send(void)
+static void send_nibbles(struct PHL *l, unsigned char *p, int len)
 {
-    static int last_ts = 0;
-    int n, send_tail = sq_head, send_bytes;
+    int i;
 
-    if (last_ts == 0) 
-        last_ts = now;
+    for (i = 0; i < len; i++) {
+        send_byte(l, p[i] & 0x0f);
+        send_byte(l, (p[i] & 0xf0) >> 4);
+    }
+}
 
-    if (now <= last_ts) 
+/* 
+    crc_len: 4 if the CRC of the frame is to follow it, see send_frame_crc().
+    The datalink program tells a retransmission, which flags its packet in 
+    the send time, under the CRC: the delimiters stay as they are.
+*/
+static int frame_send(unsigned char *frame, int len, int crc_len, int resent)
+{
+    int i, n, hlen = 0, off = frame_pkt_off(frame, len), wlen = len + crc_len;
+    unsigned int crc = crc32_init();
+    unsigned char hdr[2], trl[4];
+    struct PHL *l = link_pick();
+
+    ps->last_link = (int)(l - ps->link);
+
+    if (!sq_reserve(l, ps->framing == FRAMING_COBS ? wlen + wlen / 254 + 7 : wlen * 2 + 6)) {
+        dbg_warning("Physical Layer Sending Queue is full (%d KB), frame dropped\n", l->sq_size / 1024);
+        ps->phl_blocked = 1;
+        return PHL_DROPPED;
+    }
+    ps->tx_frame_bytes += wlen;
+    if (!resent)
+        off = -1;
+    else {
+        ps->resent_tx++;
+        if (off >= 0)
+            frame[off + 5] |= PKT_RESENT;
+    }
+
+    if (nlink > 1) {
+        hdr[0] = ps->tx_seq++;
+        hdr[1] = hdr[0] ^ BOND_CHECK;
+        hlen = 2;
+    }
+
+    if (ps->framing == FRAMING_COBS) {
+        send_byte(l, 0x00);
+        send_cobs(l, hdr, hlen, frame, len, crc_len ? &crc : NULL);
+        send_byte(l, 0x00);
+    } else {
+        send_byte(l, 0xff);
+        send_nibbles(l, hdr, hlen);
+        for (i = 0; i < len; i += n) {
+            n = len - i < CRC_CHUNK ? len - i : CRC_CHUNK;
+            if (crc_len)
+                crc = crc32_update(crc, frame + i, n);
+            send_nibbles(l, frame + i, n);
+        }
+        if (crc_len) {
+            crc = crc32_final(crc);
+            for (i = 0; i < 4; i++)
+                trl[i] = (unsigned char)(crc >> (8 * i));
+            send_nibbles(l, trl, 4);
+        }
+        send_byte(l, 0xff);
+    }
+    if (off >= 0)
+        frame[off + 5] &= ~PKT_RESENT;
+
+    if (link_sq_len(l) >= sq_high) {
+        ps->phl_blocked = 1;
+        return PHL_WOULD_BLOCK;
+    }
+    return PHL_OK;
+}
+
+int send_frame(unsigned char *frame, int len)
+{
+    return frame_send(frame, len, 0, 0);
+}
+
+/* the CRC is taken as the frame is encoded, the frame is read once */
+int send_frame_crc(unsigned char *frame, int len)
+{
+    return frame_send(frame, len, 4, 0);
+}
+
+int resend_frame_crc(unsigned char *frame, int len)
+{
+    return frame_send(frame, len, 4, 1);
+}
+
+static int send_sq_data(struct PHL *l, unsigned int start, unsigned int end1)
+{
+    if (start >= end1) 
+        return 0;
+
+    return phl_send(l, &l->sq[start], end1 - start);
+}
+
+static void socket_send(struct PHL *l)
+{
+    int n, send_tail = l->sq_head, send_bytes;
+
+    if (l->send_ts == 0) 
+        l->send_ts = now;
+
+    if (now <= l->send_ts) 
+        return;
+
+    if (!ps->peer && !replay_send(l)) {
+        l->send_ts = now;
         return;
+    }
 
-    send_bytes_allowed = (now - last_ts) * CHAN_BPS / 8 / 1000 * 2;
-    n = sq_len();
-    if (n > send_bytes_allowed)
-        n = send_bytes_allowed;
-    sq_inc(send_tail, n);
+    {
+        long long n1000 = (long long)(now - l->send_ts) * ps->tx_chan->bps * WIRE_BYTES(ps) / 8 + l->send_bytes_frac;
+        l->send_bytes_allowed = (int)(n1000 / 1000);
+        l->send_bytes_frac = (int)(n1000 % 1000);
+    }
 
-    if (send_tail >= sq_head) 
-        send_bytes = send_sq_data(sq_head, send_tail);
+    n = sq_len(l);
+    if (mode_proxy) {
+        /* chanemu paces the bytes, just keep track of its sending queue */
+        l->vq_len = l->vq_len > l->send_bytes_allowed ? l->vq_len - l->send_bytes_allowed : 0;
+        l->send_bytes_allowed = 0;
+    } else if (n > l->send_bytes_allowed)
+        n = l->send_bytes_allowed;
+    sq_inc(l, send_tail, n);
+
+    if (send_tail >= l->sq_head) 
+        send_bytes = send_sq_data(l, l->sq_head, send_tail);
     else {
-        send_bytes = send_sq_data(sq_head, SQ_SIZE);
-        send_bytes += send_sq_data(0, send_tail);
+        send_bytes = send_sq_data(l, l->sq_head, l->sq_size);
+        if (send_bytes == l->sq_size - l->sq_head)
+            send_bytes += send_sq_data(l, 0, send_tail);
     }
 
-    sq_inc(sq_head, send_bytes);
-    send_bytes_allowed -= send_bytes;
+    sq_inc(l, l->sq_head, send_bytes);
+    if (mode_proxy)
+        l->vq_len += send_bytes;
+    else
+        l->send_bytes_allowed -= send_bytes;
 
-    last_ts = now;
+    l->send_ts = now;
 }
 
 /* Physical Layer: Receiver */
 
-#define BLKSIZE (16 * CHAN_BPS / 8 / (1000 / DEFAULT_TICK))
+/* 16 ticks of received data, sized for the receiving channel rate */
+#define BLKSIZE(bps) (16 * (bps) / 8 / (1000 / DEFAULT_TICK))
+#define MIN_BLKSIZE 64
 
 struct BLK {
     int commit_ts;
     int rptr, wptr;
     struct BLK *link;
-    unsigned char data[BLKSIZE];
+    unsigned char data[1];
 };
 
-static struct BLK *rblk_head, *rblk_tail;
-static unsigned int nbits;
+static void blk_commit(struct PROTOCOL_STATE *rs, struct PHL *l, struct BLK *blk);
+
 
-static void socket_recv(void)
+static void socket_recv(struct PHL *l)
 {
     struct BLK *blk;
-    unsigned char *p;
 
-    blk = (struct BLK *)malloc(sizeof(struct BLK));
+    if (ps->blksize == 0) {
+        int i, bps = ps->rx_chan->bps;
+        for (i = 0; i < ps->nphase; i++) {
+            if (ps->phases[i].chan[ps->rx_chan - ps->chan].bps > bps)
+                bps = ps->phases[i].chan[ps->rx_chan - ps->chan].bps;
+        }
+        ps->blksize = BLKSIZE(bps);
+        if (ps->blksize < MIN_BLKSIZE)
+            ps->blksize = MIN_BLKSIZE;
+    }
+
+    blk = (struct BLK *)malloc(sizeof(struct BLK) + ps->blksize);
     if (blk == NULL) 
         ABORT("No enough memory");
 
     blk->rptr = 0;
-    blk->wptr = recv(sock, (char *)blk->data, BLKSIZE, 0);
+    blk->wptr = recv(l->sock, (char *)blk->data, ps->blksize, 0);
     if (blk->wptr <= 0) {
-        lprintf("TCP disconnected.\n");
-        exit(0);
+        if (blk->wptr == 0 || !sock_again())
+            session_resume(l);
+        free(blk);
+        return;
     }
-    nbits += blk->wptr * 4;
-
-    /* Impose noise */
-    if (ber != 0.0) {
-        int a;
-        double rate, fact;
-
-        rate = (double)noise / nbits;
-        fact = rate > ber ? 3.5 : 6.0;
-        a = (int)((1.0 - pow(1.0 - ber, fact * blk->wptr)) * (RAND_MAX + 1.0) + 0.5);
-        if (rand() <= a) {
-            p = &blk->data[rand() % blk->wptr];
-            if (*p & 0x0f) {
-                *p ^= 1 << (rand() % 8);
-                noise++;
-                dbg_warning("Impose noise on received data, %u/%u=%.1E\n", noise, nbits, (double)noise / nbits);
-            }
+
+    blk_commit(ps, l, blk);
+}
+
+/* station 'rs' has received 'blk' on its link 'l' */
+static void blk_commit(struct PROTOCOL_STATE *rs, struct PHL *l, struct BLK *blk)
+{
+    l->rx_bytes += blk->wptr;
+
+    if (mode_proxy) 
+        /* noise and delay have been imposed by chanemu */
+        blk->commit_ts = now;
+    else {
+        l->nbits += blk->wptr * 8 / WIRE_BYTES(rs);
+
+        /* Impose noise */
+        if (impose_noise(&rs->rand_seed, blk->data, blk->wptr, 8 / WIRE_BYTES(rs), rs->rx_chan->ber, (double)l->noise / l->nbits)) {
+            l->noise++;
+            dbg_warning("Impose noise on received data, %u/%u=%.1E\n", l->noise, l->nbits, (double)l->noise / l->nbits);
         }
-    }
 
-    blk->commit_ts = now + CHAN_DELAY - 10;
+        blk->commit_ts = now + rs->rx_chan->delay - 10;
+    }
     blk->link = NULL; 
 
-    if (rblk_head == NULL) 
-        rblk_head = rblk_tail = blk;
+    if (l->rblk_head == NULL) 
+        l->rblk_head = l->rblk_tail = blk;
     else {
-        rblk_tail->link = blk;
-        rblk_tail = blk;
+        l->rblk_tail->link = blk;
+        l->rblk_tail = blk;
     }
 }
 
-static unsigned char recv_byte(void)
+/* fleet instances have no socket: the bytes go to the same link of the peer */
+static void fleet_deliver(struct PHL *l, unsigned char *buf, int len)
+{
+    struct PROTOCOL_STATE *peer = ps->peer;
+    struct BLK *blk;
+
+    blk = (struct BLK *)malloc(sizeof(struct BLK) + len);
+    if (blk == NULL) 
+        ABORT("No enough memory");
+
+    memcpy(blk->data, buf, len);
+    blk->rptr = 0;
+    blk->wptr = len;
+    blk_commit(peer, &peer->link[l - ps->link], blk);
+}
+
+static unsigned char recv_byte(struct PHL *l)
 {
     unsigned char ch;
-    struct BLK *blk = rblk_head;
+    struct BLK *blk = l->rblk_head;
 
     if (blk == NULL || blk->commit_ts > now) 
         ABORT("recv_byte(): Receiving Queue is empty");
 
     ch = blk->data[blk->rptr++];
     if (blk->rptr == blk->wptr) {
-        rblk_head = blk->link;
+        l->rblk_head = blk->link;
         free(blk);
     } 
     
@@ -531,39 +1983,37 @@ static unsigned char recv_byte(void)
 
 /* Timer Management */
 
-#define NTIMER 129
-static int timer[NTIMER];
 #define ACK_TIMER_ID (NTIMER - 1)
 
 void start_timer(unsigned int nr, unsigned int ms)
 {
     if (nr >= ACK_TIMER_ID) 
         ABORT("start_timer(): timer No. must be 0~128");
-    timer[nr] = now + phl_sq_len() * 8000 / CHAN_BPS + ms;
+    ps->timer[nr] = now + (int)((long long)link_sq_len(&ps->link[ps->last_link]) * 2 / WIRE_BYTES(ps) * 8000 / ps->tx_chan->bps) + ms;
 }
 
 void stop_timer(unsigned int nr)
 {
     if (nr < ACK_TIMER_ID) 
-        timer[nr] = 0;
+        ps->timer[nr] = 0;
 }
 
 int get_timer(unsigned int nr)
 {
-    if (nr >= ACK_TIMER_ID || timer[nr] == 0)
+    if (nr >= ACK_TIMER_ID || ps->timer[nr] == 0)
         return 0;
-    return timer[nr] > now ? timer[nr] - now : 0;
+    return ps->timer[nr] > now ? ps->timer[nr] - now : 0;
 }
 
 void start_ack_timer(unsigned int ms)
 {
-    if (timer[ACK_TIMER_ID] == 0)
-        timer[ACK_TIMER_ID] = now + ms;
+    if (ps->timer[ACK_TIMER_ID] == 0)
+        ps->timer[ACK_TIMER_ID] = now + ms;
 }
 
 void stop_ack_timer(void)
 {
-    timer[ACK_TIMER_ID] = 0;
+    ps->timer[ACK_TIMER_ID] = 0;
 }
 
 static int scan_timer(int *nr)
@@ -571,9 +2021,9 @@ static int scan_timer(int *nr)
     int i;
 
     for (i = 0; i < NTIMER; i++) {
-        if (timer[i] && timer[i] <= now) {
+        if (ps->timer[i] && ps->timer[i] <= now) {
             *nr = i;
-            timer[i] = 0;
+            ps->timer[i] = 0;
             return i == ACK_TIMER_ID ? ACK_TIMEOUT : DATA_TIMEOUT;
         }
     }
@@ -582,105 +2032,978 @@ static int scan_timer(int *nr)
 
 /* Network Layer Functions */
 
-static int network_layer_active = 0;
-static int rpackets, rbytes;
 
 void enable_network_layer(void)
 {
-    network_layer_active = 1;
+    ps->network_layer_active = 1;
 }
 
 void disable_network_layer(void)
 {
-    network_layer_active = 0;
+    ps->network_layer_active = 0;
+}
+
+/* Traffic Generator */
+
+static double exp_ms(double mean)
+{
+    return -log((chan_rand(&ps->rand_seed) + 1.0) / (CHAN_RAND_MAX + 1.0)) * mean;
+}
+
+static double pareto_ms(double mean, double shape)
+{
+    return mean * (shape - 1.0) / shape / pow((chan_rand(&ps->rand_seed) + 1.0) / (CHAN_RAND_MAX + 1.0), 1.0 / shape);
+}
+
+#define GENERATED() (nflow || traffic.model != TRAFFIC_LEGACY)   /* packets come from traffic_arrive() */
+
+static struct TRAFFIC *flow_traffic(int f)
+{
+    return nflow ? &flows[f].traffic : &traffic;
+}
+
+static struct PKT_SIZES *flow_sizes(int f)
+{
+    return nflow ? &flows[f].sizes : &ps->sizes;
+}
+
+/* flow 0 of the stations has the payload of the implicit flow */
+static struct FLOW_STATE *flow_state(int f)
+{
+    struct FLOW_STATE *fs;
+    int i, n = nflow ? nflow : 1;
+
+    if (ps->flow == NULL) {
+        ps->flow = (struct FLOW_STATE *)calloc(n, sizeof(struct FLOW_STATE));
+        if (ps->flow == NULL)
+            ABORT("No enough memory");
+        for (i = 0; i < n; i++) {
+            fs = &ps->flow[i];
+            fs->tx.holdrand = (ps->station == 'a' ? 0x65109bc4 : 0x1e459090) + i * 0x9e3779b9;
+            fs->tx.lenrand = (ps->station == 'a' ? 0x3c6ef372 : 0x5be0cd19) + i * 0x9e3779b9;
+            fs->rx.holdrand = (ps->station == 'a' ? 0x1e459090 : 0x65109bc4) + i * 0x9e3779b9;
+            fs->rx.lenrand = (ps->station == 'a' ? 0x5be0cd19 : 0x3c6ef372) + i * 0x9e3779b9;
+            fs->tx.head = fs->rx.head = PAYLOAD_BATCH;
+        }
+    }
+    return &ps->flow[f];
+}
+
+/* queue the packets of flow 'f' arrived by now, whether the datalink takes them or not */
+static void traffic_arrive(int f)
+{
+    struct TRAFFIC *t = flow_traffic(f);
+    struct FLOW_STATE *fs = flow_state(f);
+
+    if (fs->tq == NULL) {
+        fs->tq = (int *)malloc(traffic_queue * sizeof(int));
+        if (fs->tq == NULL)
+            ABORT("No enough memory");
+        fs->tg_ts0 = now;
+        fs->tg_next = now;
+        fs->tg_on_end = now + pareto_ms(t->on_ms, t->shape);
+    }
+
+    if (t->model == TRAFFIC_BACKLOG) {
+        for (; fs->tq_len < traffic_queue; fs->tg_offered++)
+            fs->tq[(fs->tq_head + fs->tq_len++) % traffic_queue] = now;
+        return;
+    }
+
+    while (fs->tg_next <= now) {
+        if (fs->tq_len == traffic_queue)
+            fs->tg_drops++;
+        else
+            fs->tq[(fs->tq_head + fs->tq_len++) % traffic_queue] = (int)fs->tg_next;
+        fs->tg_offered++;
+
+        fs->tg_next += t->model == TRAFFIC_POISSON ? exp_ms(1000.0 / t->pps) : 1000.0 / t->pps;
+        if (t->model == TRAFFIC_ONOFF && fs->tg_next >= fs->tg_on_end) {
+            fs->tg_next = fs->tg_on_end + pareto_ms(t->off_ms, t->shape);
+            fs->tg_on_end = fs->tg_next + pareto_ms(t->on_ms, t->shape);
+        }
+    }
+}
+
+/* offered load of this station, bytes are estimated by the mean packet length */
+static void traffic_stat(void)
+{
+    struct FLOW_STATE *fs;
+    double secs;
+    char name[32] = "";
+    int f;
+
+    if (!GENERATED() || ps->relay || ps->flow == NULL)
+        return;
+    for (f = 0; f < (nflow ? nflow : 1); f++) {
+        fs = &ps->flow[f];
+        secs = (now - fs->tg_ts0) / 1000.0;
+        if (fs->tq == NULL || secs <= 0.0)
+            continue;
+        if (nflow)
+            sprintf(name, "flow %d %s ", f, flow_name(f));
+        lprintf(".... %s%s: offered %.1f pps (%.0f bps), sent %.1f pps, %u dropped, queue %d, wait %.0f ms\n", 
+            name, traffic_names[flow_traffic(f)->model], fs->tg_offered / secs, fs->tg_offered * pkt_sizes_mean(flow_sizes(f)) * 8 / secs, 
+            fs->tg_sent / secs, fs->tg_drops, fs->tq_len, fs->tg_sent ? fs->tg_wait / fs->tg_sent : 0.0);
+    }
+}
+
+/* File Transfer */
+
+static unsigned long long fnv_hash(unsigned long long h, unsigned char *p, int len)
+{
+    while (len-- > 0)
+        h = (h ^ *p++) * FNV_PRIME;
+    return h;
+}
+
+/* a regular file is mapped, packets are sliced from it without staging */
+static void file_open(void)
+{
+    char msg[512];
+    int pipe = 1;
+
+    if (send_file) {
+        ps->fd = strcmp(send_file, "-") == 0 ? 0 : open(send_file, O_RDONLY | O_BINARY);
+        if (ps->fd < 0) {
+            sprintf(msg, "Failed to open \"%s\"", send_file);
+            ABORT(msg);
+        }
+#ifdef _WIN32
+        /* no select() on a pipe here, a blocking read() would stall the station */
+        if (GetFileType((HANDLE)_get_osfhandle(ps->fd)) != FILE_TYPE_DISK) {
+            sprintf(msg, "\"%s\" is not a regular file", send_file);
+            ABORT(msg);
+        }
+        pipe = 0;
+        if (!pipe && (ps->fsize = _filelengthi64(ps->fd)) > 0) {
+            HANDLE m = CreateFileMapping((HANDLE)_get_osfhandle(ps->fd), NULL, PAGE_READONLY, 0, 0, NULL);
+
+            if (m == NULL || (ps->fmap = (unsigned char *)MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0)) == NULL)
+                ABORT("Failed to map the file to send");
+        }
+#else
+        {
+            struct stat st;
+
+            if (fstat(ps->fd, &st) == 0 && S_ISREG(st.st_mode))
+                pipe = 0;
+            if (!pipe && st.st_size > 0) {
+                ps->fsize = st.st_size;
+                ps->fmap = (unsigned char *)mmap(NULL, (size_t)ps->fsize, PROT_READ, MAP_PRIVATE, ps->fd, 0);
+                if (ps->fmap == MAP_FAILED)
+                    ABORT("Failed to map the file to send");
+                madvise(ps->fmap, (size_t)ps->fsize, MADV_SEQUENTIAL);
+            } else if (pipe)
+                fcntl(ps->fd, F_SETFL, fcntl(ps->fd, F_GETFL) | O_NONBLOCK);
+        }
+#endif
+        /* an empty regular file has nothing to map, and no more to read */
+        if (!pipe && ps->fmap == NULL)
+            ps->feof = 1;
+        if (ps->fmap)
+            lprintf("Sending \"%s\", %lld bytes\n", send_file, ps->fsize);
+        else
+            lprintf("Sending \"%s\"\n", send_file);
+    }
+
+    if (recv_file) {
+        ps->ofd = open(recv_file, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+        if (ps->ofd < 0) {
+            sprintf(msg, "Failed to create \"%s\"", recv_file);
+            ABORT(msg);
+        }
+    }
+}
+
+/* 
+    limit the credit to an upper bound of the packets left (a byte each, and 
+    the FILE_END), a pipe offers one packet once readable
+*/
+static int file_credit(int n)
+{
+    if (ps->fdone)
+        return 0;
+    if (ps->fmap || ps->feof)
+        return ps->fsize - ps->fpos + 1 < n ? (int)(ps->fsize - ps->fpos + 1) : n;
+#ifndef _WIN32
+    {
+        fd_set rfds;
+        struct timeval tv = { 0, 0 };
+
+        FD_ZERO(&rfds);
+        FD_SET(ps->fd, &rfds);
+        if (select(ps->fd + 1, &rfds, NULL, NULL, &tv) <= 0)
+            return 0;
+    }
+#endif
+    return 1;
+}
+
+/* at most 'len' (FILE_HDR + 16 at least, room for FILE_END) bytes of packet, return the length */
+static int file_slice(unsigned char *packet, int len)
+{
+    int n = len - FILE_HDR;
+
+    if (ps->f_ts0 == 0)
+        ps->f_ts0 = now;
+
+    if (ps->fmap) {
+        if (n > ps->fsize - ps->fpos)
+            n = (int)(ps->fsize - ps->fpos);
+        memcpy(packet + FILE_HDR, ps->fmap + ps->fpos, n);
+    } else if (!ps->feof) {
+        n = read(ps->fd, packet + FILE_HDR, n);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            lprintf("WARNING: Failed to read \"%s\": %s, the file is cut here\n", send_file, strerror(errno));
+            n = 0;
+        }
+        if (n == 0)
+            ps->feof = 1;
+        if (n < 0)
+            n = 0;
+        ps->fsize += n;
+    } else
+        n = 0;
+
+    if (n > 0 || (ps->fmap == NULL && !ps->feof)) {
+        packet[PKT_HDR] = FILE_DATA;
+        ps->fhash = fnv_hash(ps->fhash, packet + FILE_HDR, n);
+        ps->fpos += n;
+        return n + FILE_HDR;
+    }
+
+    packet[PKT_HDR] = FILE_END;
+    memcpy(packet + FILE_HDR, &ps->fsize, 8);
+    memcpy(packet + FILE_HDR + 8, &ps->fhash, 8);
+    ps->fdone = 1;
+    lprintf("File sent: %lld bytes in %.1f s, hash %016llx\n", ps->fsize, (now - ps->f_ts0) / 1000.0, ps->fhash);
+    return FILE_HDR + 16;
+}
+
+/* cut the preallocation, also when the station quits before the end of the file */
+static void file_close(void)
+{
+    if (ps->ofd < 0)
+        return;
+#ifdef _WIN32
+    _chsize_s(ps->ofd, ps->osize);
+#else
+    if (ftruncate(ps->ofd, (off_t)ps->osize) < 0)
+        lprintf("WARNING: Failed to truncate \"%s\"\n", recv_file);
+#endif
+    close(ps->ofd);
+    ps->ofd = -1;
+}
+
+/* written straight from the packet into a file preallocated in FILE_CHUNKs */
+static void file_recv(unsigned char *packet, int len)
+{
+    long long size;
+    unsigned long long hash;
+    double secs;
+
+    if (len < FILE_HDR || (packet[PKT_HDR] == FILE_END && len != FILE_HDR + 16))
+        ABORT("Bad Packet length");
+
+    if (packet[PKT_HDR] == FILE_DATA) {
+        if (ps->o_ts0 == 0)
+            ps->o_ts0 = now;
+        ps->ohash = fnv_hash(ps->ohash, packet + FILE_HDR, len - FILE_HDR);
+        if (ps->ofd >= 0) {
+#ifndef _WIN32
+            if (ps->osize + len - FILE_HDR > ps->oalloc) {
+                ps->oalloc = ps->osize + len - FILE_HDR + FILE_CHUNK;
+                posix_fallocate(ps->ofd, 0, (off_t)ps->oalloc);
+            }
+#endif
+            if (write(ps->ofd, packet + FILE_HDR, len - FILE_HDR) != len - FILE_HDR)
+                ABORT("Failed to write the file received");
+        }
+        ps->osize += len - FILE_HDR;
+        return;
+    }
+    if (packet[PKT_HDR] != FILE_END)
+        ABORT("Network Layer received a bad file packet");
+
+    memcpy(&size, packet + FILE_HDR, 8);
+    memcpy(&hash, packet + FILE_HDR + 8, 8);
+    file_close();
+    secs = ps->o_ts0 ? (now - ps->o_ts0) / 1000.0 : 0.0;
+    lprintf("File received: %lld bytes in %.1f s (%.0f bps), hash %016llx, %s\n", ps->osize, secs, 
+        secs > 0.0 ? ps->osize * 8 / secs : 0.0, ps->ohash, 
+        size == ps->osize && hash == ps->ohash ? "OK" : "MISMATCH");
+}
+
+/* packets of the relay or the source, 0 if none */
+static int offered_credit(void)
+{
+    int f, n = 0;
+
+    if (GENERATED() && !ps->relay) {
+        for (f = 0; f < (nflow ? nflow : 1); f++) {
+            traffic_arrive(f);
+            n += ps->flow[f].tq_len;
+        }
+    }
+
+    if (!ps->network_layer_active)
+        return 0;
+
+    /* a relay forwards whatever is queued for the hop */
+    if (ps->relay)
+        return ps->rq_len;
+
+    if (GENERATED())
+        return n;
+
+    /* station B offers only the report */
+    if (bulk_packets && ps->station == 'a')
+        return bulk_packets - (int)ps->bulk_fetched < FLOOD_CREDIT ? bulk_packets - (int)ps->bulk_fetched : FLOOD_CREDIT;
+    if (bulk_packets)
+        return ps->bulk_state == BULK_DONE;
+
+    if (mode_flood) 
+        return FLOOD_CREDIT;
+
+    if ((double)(now - ps->layer3_ts) * ps->tx_chan->bps * nlink / 8 / 1000 < pkt_sizes_mean(&ps->sizes) * 3 / 4)
+        return 0;
+
+    if (ps->station == 'b') {
+        if (now / 1000 / mode_cycle % 2 != mode_ibib) {
+            if (now - ps->layer3_ts < 4000 + chan_rand(&ps->rand_seed) % 500)
+                return 0;
+        }
+        if (now < ps->rx_chan->delay + (int)((long long)3 * ps->sizes.max * 8000 / ps->rx_chan->bps))
+            return 0;
+    }
+
+    ps->layer3_ts = now;
+
+    return 1;
+}
+
+/* return the packets that can be fetched at once, 0 if none */
+static int network_layer_ready(void)
+{
+    int n = offered_credit();
+
+    if (n > 0 && ps->fd >= 0)
+        n = file_credit(n);
+    return n;
+}
+
+#define LCG_MUL 214013u
+#define LCG_ADD 2531011u
+
+/* multiplier and increment of n LCG steps at once */
+static void lcg_jump(unsigned int n, unsigned int *mul, unsigned int *add)
+{
+    unsigned int m = LCG_MUL, a = LCG_ADD;
+
+    *mul = 1;
+    *add = 0;
+    for (; n; n >>= 1) {
+        if (n & 1) {
+            *mul *= m;
+            *add = *add * m + a;
+        }
+        a *= m + 1;
+        m *= m;
+    }
+}
+
+/* 
+    Lane j yields bytes j, j + PAYLOAD_LANES, ... of the batch and steps 
+    PAYLOAD_LANES states at a time. The lanes are independent, so the 
+    compiler turns the two inner loops into vector instructions.
+*/
+static void payload_fill(struct PAYLOAD_STREAM *s)
+{
+    unsigned int lane[PAYLOAD_LANES], x = s->holdrand, mul, add;
+    int i, j;
+
+    for (j = 0; j < PAYLOAD_LANES; j++)
+        lane[j] = x = x * LCG_MUL + LCG_ADD;
+
+    lcg_jump(PAYLOAD_LANES, &mul, &add);
+    for (i = 0; i < PAYLOAD_BATCH; i += PAYLOAD_LANES) {
+        for (j = 0; j < PAYLOAD_LANES; j++)
+            s->buf[i + j] = (unsigned char)(lane[j] >> 16);
+        for (j = 0; j < PAYLOAD_LANES; j++)
+            lane[j] = lane[j] * mul + add;
+    }
+
+    lcg_jump(PAYLOAD_BATCH, &mul, &add);
+    s->holdrand = s->holdrand * mul + add;
+    s->head = 0;
+}
+
+static void payload_read(struct PAYLOAD_STREAM *s, unsigned char *data, int len)
+{
+    int n;
+
+    for (; len > 0; data += n, len -= n) {
+        if (s->head == PAYLOAD_BATCH)
+            payload_fill(s);
+        n = PAYLOAD_BATCH - s->head < len ? PAYLOAD_BATCH - s->head : len;
+        memcpy(data, s->buf + s->head, n);
+        s->head += n;
+    }
+}
+
+/* return 0 if 'data' differs from the stream */
+static int payload_verify(struct PAYLOAD_STREAM *s, unsigned char *data, int len)
+{
+    int n;
+
+    for (; len > 0; data += n, len -= n) {
+        if (s->head == PAYLOAD_BATCH)
+            payload_fill(s);
+        n = PAYLOAD_BATCH - s->head < len ? PAYLOAD_BATCH - s->head : len;
+        if (memcmp(data, s->buf + s->head, n) != 0)
+            return 0;
+        s->head += n;
+    }
+    return 1;
+}
+
+/* drop 'n' bytes of the stream, what is not buffered is jumped over */
+static void payload_skip(struct PAYLOAD_STREAM *s, unsigned int n)
+{
+    unsigned int mul, add;
+
+    if (n <= (unsigned int)(PAYLOAD_BATCH - s->head)) {
+        s->head += n;
+        return;
+    }
+    lcg_jump(n - (PAYLOAD_BATCH - s->head), &mul, &add);
+    s->holdrand = s->holdrand * mul + add;
+    s->head = PAYLOAD_BATCH;
+}
+
+/* length of the next packet of the stream */
+static int payload_len(struct PAYLOAD_STREAM *s, struct PKT_SIZES *z)
+{
+    int r;
+
+    if (z->dist == SIZE_FIXED)
+        return z->min;
+    r = ((s->lenrand = s->lenrand * LCG_MUL + LCG_ADD) >> 16) & 0x7fff;
+    if (z->dist == SIZE_UNIFORM && z->max - z->min >= 0x8000)
+        r |= (((s->lenrand = s->lenrand * LCG_MUL + LCG_ADD) >> 16) & 0x7fff) << 15;    /* 30 bits */
+    if (z->dist == SIZE_UNIFORM)
+        return z->min + r % (z->max - z->min + 1);
+    return r % 100 < z->pct ? z->min : z->max;
+}
+
+static int size_class(int len)
+{
+    int c;
+
+    for (c = 0; c < SIZE_CLASSES - 1 && len > 32 << c; c++)
+        ;
+    return c;
+}
+
+int pkt_len_max(void)
+{
+    int f, n = nflow ? MIN_PKT_LEN : ps->sizes.max;
+
+    for (f = 0; f < nflow; f++) {
+        if (flows[f].sizes.max > n)
+            n = flows[f].sizes.max;
+    }
+    return n;
+}
+
+/* remembered until the packet goes out in a frame, see frame_pkt_off() */
+static void sent_record(unsigned char *packet)
+{
+    struct SENT_PKT *sp = &ps->sent[ps->sent_next++ % SENT_RING];
+
+    memcpy(sp->hdr, packet, PKT_HDR);
+    sp->sends = 1;
+}
+
+/* of flow 'f', drawn ahead for the round robin */
+static int flow_next_len(int f)
+{
+    struct FLOW_STATE *fs = flow_state(f);
+
+    if (fs->next_len == 0)
+        fs->next_len = payload_len(&fs->tx, flow_sizes(f));
+    return fs->next_len;
+}
+
+/* 
+    Strict priority first. A weighted flow earns weight * DRR_QUANTUM bytes 
+    when its round comes, and sends while its next packet fits; an idle 
+    flow saves nothing up.
+*/
+static int flow_pick(void)
+{
+    struct FLOW_STATE *fs;
+    int f, best = -1;
+
+    for (f = 0; f < nflow; f++) {
+        if (flows[f].prio >= 0 && ps->flow[f].tq_len && (best < 0 || flows[f].prio < flows[best].prio))
+            best = f;
+    }
+    if (best >= 0)
+        return best;
+
+    for (;;) {
+        fs = &ps->flow[ps->drr];
+        if (fs->tq_len == 0 || flows[ps->drr].prio >= 0)
+            fs->deficit = 0;
+        else if (fs->deficit >= flow_next_len(ps->drr)) {
+            fs->deficit -= fs->next_len;
+            return ps->drr;
+        }
+        ps->drr = (ps->drr + 1) % nflow;
+        if (ps->flow[ps->drr].tq_len && flows[ps->drr].prio < 0)
+            ps->flow[ps->drr].deficit += flows[ps->drr].weight * DRR_QUANTUM;
+    }
+}
+
+/* Bulk Transfer */
+
+/* the completion time against the packets back to back at the channel rate */
+static void bulk_print(struct BULK_SUMMARY *b)
+{
+    int bps = ps->chan[CHAN_AB].bps * nlink;
+    double ceiling = b->bytes * 8000.0 / bps + ps->chan[CHAN_AB].delay;
+
+    lprintf("Bulk transfer: %u packets, %lld bytes in %.3f s (%.0f bps), %u lost\n", b->packets, b->bytes, 
+        b->ms / 1000.0, b->ms > 0 ? b->bytes * 8000.0 / b->ms : 0.0, b->lost);
+    lprintf("    %u retransmissions, %u NAKs, %u bad CRC\n", b->resent, b->naks, b->bad_crc);
+    lprintf("    ceiling %.3f s at %d bps, efficiency %.1f%%\n", ceiling / 1000.0, bps, 
+        b->ms > 0 ? ceiling * 100.0 / b->ms : 0.0);
+}
+
+/* station B has the last packet */
+static void bulk_complete(void)
+{
+    struct FLOW_STATE *fs = flow_state(0);
+
+    ps->bulk_state = BULK_DONE;
+    ps->bulk.ms = now - ps->bulk_ts0;
+    ps->bulk.packets = fs->rpackets;
+    ps->bulk.bytes = fs->rbytes;
+    ps->bulk.lost = ps->lost;
+    ps->bulk.resent = ps->resent_rx;
+    ps->bulk.naks = ps->dl_count[COUNT_NAK];
+    ps->bulk.bad_crc = ps->dl_count[COUNT_BAD_CRC];
+    bulk_print(&ps->bulk);
+}
+
+/* the report of station B travels as a file packet */
+static int bulk_report(unsigned char *packet)
+{
+    struct FLOW_STATE *fs = flow_state(0);
+    unsigned int ts = now;
+
+    *(unsigned short *)packet = (ps->station - 'a' + 1 + FILE_PKT_NO) * 10000 + (fs->pkt_no++ % 10000);
+    memcpy(packet + 2, &ts, 4);
+    packet[6] = 0;
+    packet[PKT_HDR] = BULK_END;
+    memcpy(packet + FILE_HDR, &ps->bulk, sizeof(ps->bulk));
+    sent_record(packet);
+
+    ps->bulk_state = BULK_SENT;
+    ps->bulk_ts = now;
+    ps->layer3_credit = 0;
+    ps->tx_pkt_bytes += FILE_HDR + sizeof(ps->bulk);
+    return FILE_HDR + sizeof(ps->bulk);
+}
+
+/* station A adds what it has seen: the retransmissions, and the errors on the way back */
+static void bulk_end(unsigned char *packet, int len)
+{
+    struct BULK_SUMMARY b;
+
+    if (len != FILE_HDR + (int)sizeof(b) || ps->station != 'a')
+        ABORT("Network Layer received a bad bulk report");
+    memcpy(&b, packet + FILE_HDR, sizeof(b));
+    b.resent = ps->resent_tx;
+    b.naks += ps->dl_count[COUNT_NAK];
+    b.bad_crc += ps->dl_count[COUNT_BAD_CRC];
+    bulk_print(&b);
+    ps->bulk_state = BULK_DONE;
+}
+
+/* A quits on the report, B when A has gone or after a while */
+static int bulk_over(void)
+{
+    if (ps->station == 'a')
+        return ps->bulk_state == BULK_DONE;
+    return ps->bulk_state == BULK_SENT && now - ps->bulk_ts > BULK_LINGER;
+}
+
+int get_packet(unsigned char *packet)
+{
+    int len, f = 0;
+    unsigned int ts = now;
+    struct FLOW_STATE *fs;
+
+    if (ps->layer3_credit <= 0)
+        ABORT("get_packet(): Network layer is not ready for a new packet");
+
+    if (ps->relay) {
+        struct RELAY_PKT *rp = &ps->rq[ps->rq_head];
+
+        memcpy(packet, rp->data, rp->len);
+        ps->rq_head = (ps->rq_head + 1) % relay_queue;
+        ps->rq_len--;
+        ps->rq_out++;
+        ps->rq_wait += now - rp->ts;
+        ps->layer3_credit--;
+        ps->tx_pkt_bytes += rp->len;
+        sent_record(packet);
+        return rp->len;
+    }
+
+    if (ps->bulk_state == BULK_DONE)
+        return bulk_report(packet);
+    
+    if (nflow)
+        f = flow_pick();
+    fs = flow_state(f);
+    if (GENERATED()) {
+        fs->tg_wait += now - fs->tq[fs->tq_head];
+        fs->tq_head = (fs->tq_head + 1) % traffic_queue;
+        fs->tq_len--;
+        fs->tg_sent++;
+    }
+
+    len = flow_next_len(f);
+    fs->next_len = 0;
+    if (ps->fd >= 0)
+        len = file_slice(packet, len < FILE_HDR + 16 ? FILE_HDR + 16 : len);
+    else
+        payload_read(&fs->tx, packet + PKT_HDR, len - PKT_HDR);
+    *(unsigned short *)packet = (ps->station - 'a' + 1 + (ps->fd >= 0 ? FILE_PKT_NO : 0)) * 10000 + (fs->pkt_no++ % 10000);
+    memcpy(packet + 2, &ts, 4);
+    packet[6] = (unsigned char)f;
+    sent_record(packet);
+
+    /* nothing follows the end of a file */
+    ps->layer3_credit = ps->fdone ? 0 : ps->layer3_credit - 1;
+    ps->tx_pkt_bytes += len;
+    ps->bulk_fetched++;
+
+    return len;
+}
+
+int get_packets(unsigned char *bufs[], int lens[], int max)
+{
+    int n;
+
+    for (n = 0; n < max && ps->layer3_credit > 0; n++)
+        lens[n] = get_packet(bufs[n]);
+    return n;
+}
+
+/* a relay queues the packet for the other hop, and drops it if the queue is full */
+static void relay_forward(unsigned char *packet, int len)
+{
+    struct PROTOCOL_STATE *q = ps->relay;
+    struct RELAY_PKT *rp;
+
+    if (q->rq_len == relay_queue) {
+        q->rq_drops++;
+        dbg_warning("Relay queue is full, packet dropped\n");
+        return;
+    }
+    rp = &q->rq[(q->rq_head + q->rq_len++) % relay_queue];
+    rp->ts = now;
+    rp->len = len;
+    memcpy(rp->data, packet, len);
+    if (q->rq_len > q->rq_peak)
+        q->rq_peak = q->rq_len;
+}
+
+static void lat_record(struct LAT_HIST *h, int ms)
+{
+    int e = 0;
+    unsigned int v = ms < 0 ? 0 : ms >= 1 << LAT_MAX_LOG ? (1 << LAT_MAX_LOG) - 1 : ms;
+
+    while (v >> (e + LAT_SUB))
+        e++;
+    h->cnt[e * 32 + (v >> e)]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* the highest value of the bucket where quantile 'q' falls */
+static unsigned int lat_value(struct LAT_HIST *h, double q)
+{
+    unsigned int i, e, sum = 0, rank = (unsigned int)(q * h->n + 0.999999);
+
+    for (i = 0; i < LAT_BUCKETS - 1 && sum + h->cnt[i] < rank; i++)
+        sum += h->cnt[i];
+    e = i < 64 ? 0 : i / 32 - 1;
+    i = ((i - e * 32) << e) + (1 << e) - 1;
+    return i < h->max ? i : h->max;
+}
+
+static void latency_stat(void)
+{
+    static char *name[2] = { "sent once", "resent" };
+    struct FLOW_STATE *fs;
+    struct LAT_HIST *h;
+    char line[256], head[128] = "";
+    int f, i, n;
+
+    if (ps->relay || ps->flow == NULL)
+        return;
+    for (f = 0; f < (nflow ? nflow : 1); f++) {
+        fs = &ps->flow[f];
+        for (i = 0, n = 0; i < 2; i++) {
+            h = &fs->lat[i];
+            if (h->n)
+                n += sprintf(line + n, "%s%s %u packets %u/%u/%u/%u ms, mean %.0f ms", n ? "; " : "", name[i], h->n, 
+                    lat_value(h, 0.5), lat_value(h, 0.99), lat_value(h, 0.999), h->max, h->sum / h->n);
+        }
+        /* goodput of each flow */
+        if (nflow)
+            sprintf(head, "flow %d %s: %d packets, %.0f bps, ", f, flow_name(f), fs->rpackets, 
+                now > ps->ts0 ? fs->rbytes * 8 * 1000 / (now - ps->ts0) : 0.0);
+        if (n || nflow)
+            lprintf(".... %slatency p50/p99/p999/max: %s\n", head, n ? line : "-");
+    }
+}
+
+/* verify the packet, or queue it for the other hop of a relay */
+static void deliver_packet(unsigned char *packet, int len)
+{
+    int i, file = *(unsigned short *)packet / 10000 > FILE_PKT_NO, f = packet[6], resent;
+    unsigned int gap, skip, ts;
+    struct FLOW_STATE *fs;
+
+    if (len < MIN_PKT_LEN || len > pkt_len_max()) 
+        ABORT("Bad Packet length");
+    if (f >= (nflow ? nflow : 1))
+        ABORT("Network Layer received a packet of no flow");
+
+    /* the last hop only: a relay does not pass on how its upstream hop went */
+    resent = (packet[5] & PKT_RESENT) != 0;
+    packet[5] &= ~PKT_RESENT;
+    if (resent)
+        ps->resent_rx++;
+
+    if (ps->relay) 
+        relay_forward(packet, len);
+    else {
+        fs = flow_state(f);
+
+        /* packets dropped by a relay leave a gap in the packet No. of the flow */
+        gap = (*(unsigned short *)packet % 10000 + 10000 - fs->rx_no % 10000) % 10000;
+        if (gap && ps->peer_relay) {
+            for (i = 0, skip = 0; i < (int)gap && !file; i++)
+                skip += payload_len(&fs->rx, flow_sizes(f)) - PKT_HDR;
+            payload_skip(&fs->rx, skip);
+            fs->rx_no += gap;
+            ps->lost += gap;
+        }
+
+        if (file && len > PKT_HDR && packet[PKT_HDR] == BULK_END)
+            bulk_end(packet, len);
+        else if (file) 
+            file_recv(packet, len);
+        else {
+            if (len != payload_len(&fs->rx, flow_sizes(f))) 
+                ABORT("Bad Packet length");
+            if (!payload_verify(&fs->rx, packet + PKT_HDR, len - PKT_HDR)) 
+                ABORT("Network Layer received a bad packet from data link layer");
+        }
+        memcpy(&ts, packet + 2, 4);
+        if (fs->rpackets == 0)
+            ps->bulk_ts0 = ts;
+        lat_record(&fs->lat[resent], (int)(now - ts));
+        fs->rx_no++;
+        fs->rpackets++;
+        fs->rbytes += len;
+        ps->class_packets[size_class(len)]++;
+        ps->class_bytes[size_class(len)] += len;
+        if (bulk_packets && ps->station == 'b' && ps->bulk_state == BULK_RUNNING && fs->rx_no >= (unsigned int)bulk_packets)
+            bulk_complete();
+    }
+    ps->rpackets++;
+    ps->rbytes += len;
+}
+
+/* Goodput Meter */
+
+static void meter_totals(struct METER_SEC *m)
+{
+    int i;
+
+    m->rx = ps->rbytes;
+    m->tx_frame = ps->tx_frame_bytes;
+    m->tx_pkt = ps->tx_pkt_bytes;
+    for (i = 0, m->tx_wire = 0; i < nlink; i++)
+        m->tx_wire += ps->link[i].tx_bytes / WIRE_BYTES(ps);
+}
+
+/* 
+    Goodput, overhead (frame bytes beyond the packets fetched: headers, 
+    ACKs and retransmissions) and idle time of the sending channel, over 
+    the last seconds of each window.
+*/
+static void meter_stat(void)
+{
+    struct METER_SEC sum, *m;
+    char line[512];
+    int i, j, w, n = 0;
+    double bps;
+
+    for (i = 0; i < meter_nwin && ps->meter_cnt; i++) {
+        w = meter_windows[i] < ps->meter_cnt ? meter_windows[i] : ps->meter_cnt;
+        memset(&sum, 0, sizeof(sum));
+        for (j = 1; j <= w; j++) {
+            m = &ps->meter[(ps->meter_cnt - j) % METER_SECONDS];
+            sum.rx += m->rx;
+            sum.tx_frame += m->tx_frame;
+            sum.tx_pkt += m->tx_pkt;
+            sum.tx_wire += m->tx_wire;
+        }
+        bps = (double)sum.rx * 8 / w;
+        n += sprintf(line + n, "%s%ds: %.0f bps %.1f%%, overhead %.1f%%, idle %.1f%%", n ? "; " : "", 
+            meter_windows[i], bps, bps / ((double)ps->rx_chan->bps * nlink) * 100, 
+            sum.tx_frame ? (1.0 - (double)sum.tx_pkt / sum.tx_frame) * 100 : 0.0,
+            sum.tx_wire * 8.0 / w < (double)ps->tx_chan->bps * nlink ? 100 - sum.tx_wire * 8.0 / w / ((double)ps->tx_chan->bps * nlink) * 100 : 0.0);
+    }
+    if (n)
+        lprintf(".... %swindow %s\n", ps->relay ? (ps->station == 'b' ? "[upstream] " : "[downstream] ") : "", line);
+}
+
+/* close the bucket of the second just passed, seconds without a pass get nothing */
+static void meter_update(void)
+{
+    struct METER_SEC t, *m;
+
+    if (ps->meter_sec == 0) {
+        ps->meter_sec = now / 1000;
+        meter_totals(&ps->meter_base);
+        return;
+    }
+    if (now / 1000 == ps->meter_sec)
+        return;
+
+    meter_totals(&t);
+    for (; ps->meter_sec < now / 1000; ps->meter_sec++, ps->meter_cnt++) {
+        m = &ps->meter[ps->meter_cnt % METER_SECONDS];
+        m->rx = t.rx - ps->meter_base.rx;
+        m->tx_frame = t.tx_frame - ps->meter_base.tx_frame;
+        m->tx_pkt = t.tx_pkt - ps->meter_base.tx_pkt;
+        m->tx_wire = t.tx_wire - ps->meter_base.tx_wire;
+        ps->meter_base = t;
+    }
+
+    /* printed whether packets arrive or not, a dip shows up in time */
+    if (now - ps->meter_ts >= 2000) {
+        meter_stat();
+        ps->meter_ts = now;
+    }
 }
 
-static int network_layer_ready(void)
+static void packet_stat(void)
 {
-    static int last_ts = 0;
+    int i;
 
-    if (!network_layer_active)
-        return 0;
+    if (now - ps->stat_ts > 2000 && now > ps->ts0 + 2000) {
+        double bps, capacity = (double)ps->rx_chan->bps * nlink;
+        unsigned int nbits = 0;
+        int noise = 0;
+        char *hop = "", tail[128] = "", err[64];
+
+        if (ps->relay) {
+            hop = ps->station == 'b' ? "[upstream] " : "[downstream] ";
+            sprintf(tail, ", queue %d (peak %d), wait %.0f ms, %d dropped", ps->rq_len, ps->rq_peak, 
+                ps->rq_out ? ps->rq_wait / ps->rq_out : 0.0, ps->rq_drops);
+        } else if (ps->peer_relay)
+            sprintf(tail, ", %u lost", ps->lost);
+
+        for (i = 0; i < nlink; i++) {
+            nbits += ps->link[i].nbits;
+            noise += ps->link[i].noise;
+        }
 
-    if (mode_flood) 
-        return 1;
+        /* chanemu imposes the noise, the station sees none of it */
+        if (mode_proxy)
+            strcpy(err, "Err in chanemu log");
+        else
+            sprintf(err, "Err %d (%.1e)", noise, nbits ? (double)noise / nbits : 0.0);
+
+        bps = (double)ps->rbytes * 8 * 1000 / (now - ps->ts0);
+        if (ps->cur_phase < 0 || now <= ps->phase_ts) 
+            lprintf(".... %s%d packets received, %.0f bps, %.2f%%, %s%s\n", hop,
+                ps->rpackets, bps, bps / capacity * 100, err, tail);
+        else {
+            /* capacity varies, efficiency is only meaningful within a phase */
+            double phase_bps = (double)(ps->rbytes - ps->phase_rbytes) * 8 * 1000 / (now - ps->phase_ts);
+            lprintf(".... %s%d packets received, %.0f bps, %s, phase %d: %.0f bps, %.2f%%%s\n", hop,
+                ps->rpackets, bps, err, ps->cur_phase, phase_bps, phase_bps / capacity * 100, tail);
+        }
 
-    if ((now - last_ts) * CHAN_BPS / 8 / 1000 < PKT_LEN * 3 / 4)
-        return 0;
+        /* goodput of each size class */
+        if (!ps->relay && ps->sizes.dist != SIZE_FIXED) {
+            char line[SIZE_CLASSES * 64];   /* "; <=65536: <int> packets, <int> bps" */
+            int n = 0;
 
-    if (station == 'b') {
-        if (now / 1000 / mode_cycle % 2 != mode_ibib) {
-            if (now - last_ts < 4000 + rand() % 500)
-                return 0;
+            for (i = 0; i < SIZE_CLASSES; i++) {
+                if (ps->class_packets[i])
+                    n += sprintf(line + n, "%s<=%d: %d packets, %.0f bps", n ? "; " : "", 32 << i, 
+                        ps->class_packets[i], (double)ps->class_bytes[i] * 8 * 1000 / (now - ps->ts0));
+            }
+            lprintf(".... by size %s\n", n ? line : "-");
         }
-        if (now < CHAN_DELAY + 3 * PKT_LEN * 8000 / CHAN_BPS)
-            return 0;
+        latency_stat();
+        traffic_stat();
+        ps->stat_ts = now;
     }
-
-    last_ts = now;
-
-    return 1;
-}
-
-static int randA(void)
-{
-    static unsigned int holdrand = 0x65109bc4;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
 }
 
-static int randB(void)
+void put_packet(unsigned char *packet, int len)
 {
-    static unsigned int holdrand = 0x1e459090;
-    return ((holdrand = holdrand * 214013L + 2531011L) >> 16) & 0x7fff;
+    deliver_packet(packet, len);
+    packet_stat();
 }
 
-#define next_char() ((unsigned char)(my_rand() & 0xff))
-
-static int layer3_ready = 0;
-
-int get_packet(unsigned char *packet)
+void put_packets(unsigned char *bufs[], int lens[], int n)
 {
-    static int pkt_no = 0;
-    int i, len;
-    int (*my_rand)(void) = station == 'a' ? randA : randB;
-
-    if (!layer3_ready)
-        ABORT("get_packet(): Network layer is not ready for a new packet");
-    
-    len = PKT_LEN;
-    for (i = 2; i < len; i++)
-        packet[i] = next_char();
-    *(unsigned short *)packet = (station - 'a' + 1) * 10000 + (pkt_no++ % 10000);
-
-    layer3_ready = 0;
+    int i;
 
-    return len;
+    for (i = 0; i < n; i++)
+        deliver_packet(bufs[i], lens[i]);
+    packet_stat();
 }
 
-static int ts0;
+/* Channel Schedule */
 
-void put_packet(unsigned char *packet, int len)
+static void schedule_update(void)
 {
-    static int last_ts = 0;
-    int i, (*my_rand)(void) = station == 'a' ? randB : randA;
+    double bps;
 
-    if (len != PKT_LEN) 
-        ABORT("Bad Packet length");
+    if (ps->cur_phase + 1 >= ps->nphase || ps->phases[ps->cur_phase + 1].start > now)
+        return;
 
-    for (i = 2; i < PKT_LEN; i++) {
-        if (packet[i] != next_char()) 
-            ABORT("Network Layer received a bad packet from data link layer");
-    }
-    rpackets++;
-    rbytes += len;
+    bps = now > ps->phase_ts ? (double)(ps->rbytes - ps->phase_rbytes) * 8 * 1000 / (now - ps->phase_ts) : 0.0;
+    while (ps->cur_phase + 1 < ps->nphase && ps->phases[ps->cur_phase + 1].start <= now)
+        ps->cur_phase++;
+    memcpy(ps->chan, ps->phases[ps->cur_phase].chan, sizeof(ps->chan));
 
-    if (now - last_ts > 2000 && now > ts0 + 2000) {
-        double bps;
-        bps = (double)rbytes * 8 * 1000 / (now - ts0);
-        lprintf(".... %d packets received, %.0f bps, %.2f%%, Err %d (%.1e)\n", 
-            rpackets, bps, bps / CHAN_BPS * 100, noise, (double)noise/nbits);
-        last_ts = now;
-    }
+    lprintf("#### Phase %d begins (last phase %.0f bps): "
+        "A->B %d bps %d ms %.1E, B->A %d bps %d ms %.1E\n", ps->cur_phase, bps,
+        ps->chan[CHAN_AB].bps, ps->chan[CHAN_AB].delay, ps->chan[CHAN_AB].ber,
+        ps->chan[CHAN_BA].bps, ps->chan[CHAN_BA].delay, ps->chan[CHAN_BA].ber);
+
+    ps->phase_ts = now;
+    ps->phase_rbytes = ps->rbytes;
 }
 
 #define DBG_EVENT    0x01
@@ -709,6 +3032,12 @@ void dbg_frame(char *fmt, ...)
 	}
 }
 
+void dbg_count(int what)
+{
+    if (what >= 0 && what < NCOUNT)
+        ps->dl_count[what]++;
+}
+
 void dbg_warning(char *fmt, ...)
 {
 	va_list arg_ptr;
@@ -723,18 +3052,161 @@ void dbg_warning(char *fmt, ...)
 /* Event Generator */
 
 #define PHL_SQ_LEVEL  50 
+#define PHL_SQ_LOW    (sq_high / 2) /* recovery from PHL_WOULD_BLOCK */
 
 static int sleep_cnt, start_ms, wakeup_ms, busy_cnt;
 static int bias_cnt;
 
+/* 
+    Sized by the longest packet: what a frame may carry beyond it, the bond 
+    header and the COBS overhead before the frame is decoded in place. A 
+    longer frame has lost a delimiter and is lost.
+*/
 struct RCV_FRAME {
     int len;
     int state;
-    unsigned char frame[2048];
+    int overflow;
+    unsigned int crc;       /* of frame[BOND_HDR .. crc_pos) */
+    int crc_pos;
+    int crc_ok;             /* a frame followed by its CRC, see recv_frame_crc() */
     struct RCV_FRAME *link;
+    unsigned char frame[1]; /* ps->rf_size bytes */
 };
 
-static struct RCV_FRAME *rf_head, *rf_tail, *rf_buf;
+static struct RCV_FRAME *rf_new(void)
+{
+    struct RCV_FRAME *rf;
+    int n;
+
+    if (ps->rf_size == 0) {
+        n = pkt_len_max() + FRAME_SLACK + 2;
+        ps->rf_size = n + n / 254 + 2;
+    }
+    rf = (struct RCV_FRAME *)malloc(sizeof(struct RCV_FRAME) + ps->rf_size);
+    if (rf == NULL)
+        ABORT("No enough memory");
+    memset(rf, 0, sizeof(struct RCV_FRAME));
+    rf->crc = crc32_init();
+    rf->crc_pos = BOND_HDR;
+    return rf;
+}
+
+/* the CRC follows the decoder, over the bytes decoded since the last call */
+static void rf_crc(struct RCV_FRAME *rf, int end)
+{
+    if (end > rf->crc_pos) {
+        rf->crc = crc32_update(rf->crc, rf->frame + rf->crc_pos, end - rf->crc_pos);
+        rf->crc_pos = end;
+    }
+}
+
+/* before the frame is queued: the CRC of a frame followed by its CRC is 0 */
+static void rf_check(struct RCV_FRAME *rf)
+{
+    rf_crc(rf, rf->len);
+    rf->crc_ok = rf->len >= BOND_HDR + 4 && crc32_final(rf->crc) == 0;
+}
+
+/* 
+    In place, the frame never grows. Return 0 if the tail is missing: the 
+    frame has lost a delimiter and is lost, as it is with nibble framing.
+*/
+static int cobs_decode(struct RCV_FRAME *rf)
+{
+    int i, j, o, code, n = rf->len;
+
+    for (i = 0, o = 0; i < n; ) {
+        code = rf->frame[i++];
+        for (j = 1; j < code && i < n; j++)
+            rf->frame[o++] = rf->frame[i++];
+        if (code < 0xff && i < n)
+            rf->frame[o++] = 0;
+        rf_crc(rf, o - 1);  /* the last byte may be the tail */
+    }
+    if (o == 0 || rf->frame[o - 1] != COBS_TAIL)
+        return 0;
+    rf->len = o - 1;
+    rf_check(rf);
+    return 1;
+}
+
+static void rf_append(struct RCV_FRAME *rf)
+{
+    if (rf->len > pkt_len_max() + FRAME_SLACK) {
+        dbg_warning("Frame of %d bytes is too long, lost\n", rf->len);
+        free(rf);
+        return;
+    }
+    if (ps->rf_head == NULL) 
+        ps->rf_head = ps->rf_tail = rf;
+    else {
+        ps->rf_tail->link = rf;
+        ps->rf_tail = rf;
+    }
+}
+
+/* 
+    Bonded links deliver frames out of order, which selective repeat with 
+    a small sequence space cannot tell from old duplicates. So frames are 
+    released in bond sequence. A missing frame is given up once every link 
+    has passed it (each link is FIFO), or after the time of a whole frame.
+*/
+static int bond_release(void)
+{
+    int i, n = 0;
+
+    while (ps->reseq_cnt) {
+        if (ps->reseq[ps->rx_seq] == NULL) {
+            for (i = 0; i < nlink; i++) {
+                if (!ps->link[i].seq_valid || (signed char)(ps->link[i].last_seq - ps->rx_seq) <= 0)
+                    break;
+            }
+            if (i < nlink && now - ps->gap_ts < (int)((long long)(pkt_len_max() + 8) * 8000 / ps->rx_chan->bps) + 2 * mode_tick)
+                break;
+        } else {
+            rf_append(ps->reseq[ps->rx_seq]);
+            ps->reseq[ps->rx_seq] = NULL;
+            ps->reseq_cnt--;
+            n++;
+        }
+        ps->rx_seq++;
+        ps->gap_ts = now;
+    }
+    if (ps->reseq_cnt == 0)
+        ps->gap_ts = now;
+    return n;
+}
+
+static void bond_recv(struct PHL *l, struct RCV_FRAME *rf)
+{
+    unsigned char seq;
+
+    if (nlink == 1) {
+        rf_append(rf);
+        return;
+    }
+
+    /* a damaged header, the CRC of the frame may still be good: lose it */
+    if (rf->len < 2 || (rf->frame[0] ^ rf->frame[1]) != BOND_CHECK) {
+        free(rf);
+        return;
+    }
+    seq = rf->frame[0];
+    rf->len -= 2;
+    memmove(rf->frame, rf->frame + 2, rf->len);
+
+    l->last_seq = seq;
+    l->seq_valid = 1;
+
+    /* given up already, or a duplicate */
+    if ((signed char)(seq - ps->rx_seq) < 0 || ps->reseq[seq]) {
+        free(rf);
+        return;
+    }
+    ps->reseq[seq] = rf;
+    ps->reseq_cnt++;
+}
+
 
 int recv_frame(unsigned char *buf, int size)
 {
@@ -742,101 +3214,179 @@ int recv_frame(unsigned char *buf, int size)
     struct RCV_FRAME *next;
     char msg[256];
 
-    if (rf_head == NULL) 
+    if (ps->rf_head == NULL) 
         ABORT("recv_frame(): Receiving Queue is empty");
 
-    len = rf_head->len;
+    len = ps->rf_head->len;
 
     if (size < len) { 
         sprintf(msg, "recv_frame(): %d-byte buffer is too small to save %d-byte received frame", size, len);
         ABORT(msg);
     }
     
-    memcpy(buf, rf_head->frame, len);
+    memcpy(buf, ps->rf_head->frame, len);
 
-    next = rf_head->link;
+    next = ps->rf_head->link;
     if (next == NULL) 
-        rf_tail = NULL;
-    free(rf_head); 
-    rf_head = next;
+        ps->rf_tail = NULL;
+    free(ps->rf_head); 
+    ps->rf_head = next;
+    ps->rframes++;
 
     return len;
 }
 
-int wait_for_event(int *arg)
+/* the frame without its CRC, or -1 if the CRC is bad: the frame is dropped, not copied */
+int recv_frame_crc(unsigned char *buf, int size)
+{
+    if (ps->rf_head == NULL) 
+        ABORT("recv_frame_crc(): Receiving Queue is empty");
+
+    if (ps->rf_head->crc_ok) {
+        ps->rf_head->len -= 4;
+        return recv_frame(buf, size);
+    }
+    ps->rf_head->len = 0;
+    recv_frame(buf, size);
+    return -1;
+}
+
+/* test socket send/receive */
+static void socket_poll(void)
 {
     fd_set rfd, wfd;
     struct timeval tm;
-    int event, n, i;
+    int j, maxfd, resumes;
+    struct PHL *l;
+
+    tm.tv_sec = tm.tv_usec = 0;
+    FD_ZERO(&rfd);
+    FD_ZERO(&wfd);
+    for (j = 0, maxfd = 0; j < nlink; j++) {
+        FD_SET(ps->link[j].sock, &rfd);
+        FD_SET(ps->link[j].sock, &wfd);
+        if (ps->link[j].sock > maxfd)
+            maxfd = ps->link[j].sock;
+    }
+    /* station B may attach a link again before station A sees it break */
+    if (ps->admin_sock >= 0) {
+        FD_SET(ps->admin_sock, &rfd);
+        if (ps->admin_sock > maxfd)
+            maxfd = ps->admin_sock;
+    }
+
+    if (select(maxfd + 1, &rfd, &wfd, 0, &tm) < 0) 
+        ABORT("system select()");
+
+    for (j = 0; j < nlink; j++) {
+        l = &ps->link[j];
+        resumes = ps->resumes;
+
+        /* socket send */
+        if (FD_ISSET(l->sock, &wfd)) 
+            socket_send(l);
+
+        /* socket receive, a resumed link has a new socket */
+        if (ps->resumes == resumes && FD_ISSET(l->sock, &rfd)) 
+            socket_recv(l);
+
+        /* the resume took the connection pending on admin_sock */
+        if (ps->resumes != resumes && ps->admin_sock >= 0)
+            FD_CLR(ps->admin_sock, &rfd);
+    }
+
+    if (ps->admin_sock >= 0 && FD_ISSET(ps->admin_sock, &rfd)) {
+        unsigned int replayed;
+        int ms0 = get_ms();
+
+        l = link_accept(&replayed);
+        now = get_ms();
+        l->send_ts = now;
+        l->send_bytes_frac = 0;
+        lprintf("Link %d attached again in %d ms, %u bytes replayed\n", (int)(l - ps->link), now - ms0, replayed);
+    }
+}
+
+int wait_for_event(int *arg)
+{
+    int event, n, i, j, committed;
     unsigned char ch;
+    struct PHL *l;
 
     for (;;) {
 
         now = get_ms();
+        schedule_update();
+        meter_update();
      
-        /* commit received socket data */
-        if (rblk_head && rblk_head->commit_ts <= now) {
-            n = rblk_head->wptr - rblk_head->rptr;
+        /* commit received socket data, frames of all links are merged */
+        for (j = 0, committed = 0; j < nlink; j++) {
+            l = &ps->link[j];
+            if (l->rblk_head == NULL || l->rblk_head->commit_ts > now) 
+                continue;
+            n = l->rblk_head->wptr - l->rblk_head->rptr;
+            committed = 1;
             
-            if (ts0 == 0) {
-                ts0 = now;
-                if (ts0 >= n / 2)
-                    ts0 -= n / 2;
+            if (ps->ts0 == 0) {
+                ps->ts0 = now;
+                if (ps->ts0 >= n / 2)
+                    ps->ts0 -= n / 2;
             }
 
             for (i = 0; i < n; i++) {
-                ch = recv_byte();
-                if (ch == 0xff) {
-                    if (rf_buf == NULL) 
-                        rf_buf = (struct RCV_FRAME *)calloc(1, sizeof(struct RCV_FRAME));
+                ch = recv_byte(l);
+                if (ps->framing == FRAMING_COBS ? ch == 0x00 : ch == 0xff) {
+                    if (l->rf_buf == NULL) 
+                        l->rf_buf = rf_new();
                     else {
-                        if (rf_buf->len > 0) {
-                            if (rf_head == NULL) 
-                                rf_head = rf_tail = rf_buf;
+                        if (l->rf_buf->len > 0) {
+                            if (l->rf_buf->overflow) {
+                                dbg_warning("Frame longer than %d bytes, lost\n", ps->rf_size);
+                                free(l->rf_buf);
+                            } else if (ps->framing == FRAMING_COBS && !cobs_decode(l->rf_buf))
+                                free(l->rf_buf);
                             else {
-                                rf_tail->link = rf_buf;
-                                rf_tail = rf_buf;
+                                if (ps->framing == FRAMING_NIBBLE)
+                                    rf_check(l->rf_buf);
+                                bond_recv(l, l->rf_buf);
                             }
-                            rf_buf = NULL;
+                            l->rf_buf = NULL;
                         }
                     }
-                } else if (rf_buf && rf_buf->len < sizeof(rf_buf->frame)) {
-                    if (rf_buf->state == 0) {
-                        rf_buf->frame[rf_buf->len] = ch;
-                        rf_buf->state = 1;
+                } else if (l->rf_buf) {
+                    if (l->rf_buf->len == ps->rf_size)
+                        l->rf_buf->overflow = 1;
+                    else if (ps->framing == FRAMING_COBS)
+                        l->rf_buf->frame[l->rf_buf->len++] = ch;
+                    else if (l->rf_buf->state == 0) {
+                        l->rf_buf->frame[l->rf_buf->len] = ch;
+                        l->rf_buf->state = 1;
                     } else {
-                        rf_buf->frame[rf_buf->len] |= (ch << 4) ^ (ch & 0xf0);
-                        rf_buf->len++;
-                        rf_buf->state = 0;
+                        l->rf_buf->frame[l->rf_buf->len] |= (ch << 4) ^ (ch & 0xf0);
+                        l->rf_buf->len++;
+                        l->rf_buf->state = 0;
+                        if (l->rf_buf->len - l->rf_buf->crc_pos >= CRC_CHUNK)
+                            rf_crc(l->rf_buf, l->rf_buf->len);
                     }
                 }
             }
-
-            if (rf_head)
-                return FRAME_RECEIVED;
         }
+        if (ps->reseq_cnt && bond_release())
+            committed = 1;
+        if (committed && ps->rf_head)
+            return FRAME_RECEIVED;
         
-        /* test socket send/receive */
-        tm.tv_sec = tm.tv_usec = 0;
-        FD_ZERO(&rfd);
-        FD_ZERO(&wfd);
-        FD_SET(sock, &rfd);
-        FD_SET(sock, &wfd);
-
-        if (select(sock + 1, &rfd, &wfd, 0, &tm) < 0) 
-            ABORT("system select()");
-
-        /* socket send */
-        if (FD_ISSET(sock, &wfd)) 
-            socket_send();
-
-        /* socket receive */
-        if (FD_ISSET(sock, &rfd)) 
-            socket_recv();
+        /* test socket send/receive, the fleet has in-memory channels */
+        if (ps->peer) {
+            for (j = 0; j < nlink; j++) 
+                socket_send(&ps->link[j]);
+        } else
+            socket_poll();
 
         /* network layer event */
-        if (network_layer_ready()) {
-            layer3_ready = 1;
+        if ((n = network_layer_ready()) > 0) {
+            ps->layer3_credit = n;
+            *arg = n;
             return NETWORK_LAYER_READY;
         }
 
@@ -845,17 +3395,25 @@ int wait_for_event(int *arg)
             return event;
 
         /* physical layer event */
-        if (inform_phl_ready && phl_sq_len()  < PHL_SQ_LEVEL) {
-            inform_phl_ready = 0;
+        if (ps->inform_phl_ready && phl_sq_min() < PHL_SQ_LEVEL) {
+            ps->inform_phl_ready = 0;
+            ps->phl_blocked = 0;
+            return PHYSICAL_LAYER_READY;
+        }
+        if (ps->phl_blocked && phl_sq_min() < PHL_SQ_LOW) {
+            ps->phl_blocked = 0;
             return PHYSICAL_LAYER_READY;
         }
 
-        /* delay 'mode_tick' ms */
-        if (1) {
+        /* delay 'mode_tick' ms, the worker sleeps once for all its instances */
+        if (cur_inst) 
+            fleet_yield();
+        else if (1) {
             int ms0, t;
             static time_t last_warn;
             ms0 = get_ms();
-            magic_check();
+            if (mode_canary)
+                magic_check();
             Sleep(mode_tick);
             t = get_ms() - ms0;
             if (t > mode_tick + 50 && time(0) > last_warn + 1) {
@@ -877,7 +3435,8 @@ int wait_for_event(int *arg)
                 lprintf("------ noSleep %d, sleep %d, Elapse %d ticks\n", ticks - sleep_cnt, sleep_cnt, ticks);
             }
 
-            magic_check();
+            if (mode_canary)
+                magic_check();
             ms = get_ms();
             Sleep(mode_tick);
             wakeup_ms = get_ms();
@@ -887,17 +3446,112 @@ int wait_for_event(int *arg)
                 lprintf("++++++ Sleep(%d)=%d+%d (cnt %d)\n", mode_tick, mode_tick, ms - mode_tick, ++bias_cnt);
         }
 
-        if (now > mode_life) {
-            lprintf("Quit.\n");
-            exit(0);
-        }
+        if (now > mode_life || (bulk_packets && bulk_over()))
+            station_quit();
     }
 }
 
+static void station_quit(void)
+{
+    latency_stat();
+    traffic_stat();
+    file_close();
+    if (cur_inst)
+        fleet_quit();
+    lprintf("Quit.\n");
+    exit(0);
+}
+
 
-/* Memory Protection */
+/* 
+    Memory Protection
+
+    struct PROTOCOL_STATE lives in its own pages between two inaccessible 
+    guard pages, so a stray access running off either end of it traps at 
+    once. Only the struct is guarded: the heap buffers it points to (sending 
+    queue, received blocks and frames) and the statics outside it (ps, now, 
+    the parsed channel options and schedule) are not, and no magic words are 
+    checked then. Without guard pages (or with --canary), the state is static 
+    and bracketed by magic words which are checked once per tick.
+*/
 static unsigned int foot_magic[NMAGIC];
 
+static struct PROTOCOL_STATE *guard_alloc(void)
+{
+    size_t page, size;
+    char *base;
+
+#ifdef _WIN32
+    SYSTEM_INFO si;
+    DWORD old;
+
+    GetSystemInfo(&si);
+    page = si.dwPageSize;
+    size = (sizeof(struct PROTOCOL_STATE) + page - 1) / page * page;
+    base = (char *)VirtualAlloc(NULL, size + 2 * page, MEM_RESERVE | MEM_COMMIT, PAGE_NOACCESS);
+    if (base == NULL)
+        return NULL;
+    if (!VirtualProtect(base + page, size, PAGE_READWRITE, &old)) {
+        VirtualFree(base, 0, MEM_RELEASE);
+        return NULL;
+    }
+#else
+    page = (size_t)sysconf(_SC_PAGESIZE);
+    size = (sizeof(struct PROTOCOL_STATE) + page - 1) / page * page;
+    base = (char *)mmap(NULL, size + 2 * page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base + page, size, PROT_READ | PROT_WRITE) < 0) {
+        munmap(base, size + 2 * page);
+        return NULL;
+    }
+#endif
+
+    /* overruns are more common than underruns: end of state touches the upper guard page */
+    return (struct PROTOCOL_STATE *)(base + page + size - sizeof(struct PROTOCOL_STATE));
+}
+
+static void state_defaults(struct PROTOCOL_STATE *p)
+{
+    int i;
+
+    p->inform_phl_ready = 1;
+    p->cur_phase = -1;
+    p->port = port;
+    p->admin_sock = -1;
+    p->framing = framing;
+    p->fd = -1;
+    p->ofd = -1;
+    p->pkt_off = -1;
+    p->fhash = p->ohash = FNV_BASIS;
+    p->sizes = pkt_sizes;
+    for (i = 0; i < MAX_LINKS; i++)
+        p->link[i].sock = -1;
+}
+
+static void state_init(void)
+{
+    struct PROTOCOL_STATE *p;
+
+    /* the datalink program may have used the static state before protocol_init() */
+    state_defaults(ps);
+
+    if (!mode_canary) {
+        if ((p = guard_alloc()) != NULL) {
+            memcpy(p, ps, sizeof(struct PROTOCOL_STATE));
+            memset(ps, 0, sizeof(struct PROTOCOL_STATE));
+            ps = p;
+        } else {
+            lprintf("WARNING: Failed to allocate guard pages, use magic words instead\n");
+            mode_canary = 1;
+        }
+    }
+    if (mode_canary)
+        magic_init();
+
+    lprintf("Memory protection: %s\n", mode_canary ? "magic words" : "guard pages");
+}
+
 static void magic_init(void)
 {
     int i;
@@ -926,3 +3580,359 @@ exit:
 	ABORT("Memory used by 'protocol.lib' is corrupted by your program");
 
 }
+
+
+/* 
+    Fleet Runtime
+
+    --fleet hosts many station pairs in one process. Every station is an 
+    instance of the datalink program: main() runs on a coroutine of its 
+    own (a fiber on Windows, a ucontext on Linux) with its own protocol 
+    state, and wait_for_event() yields to the worker instead of sleeping. 
+    A pair shares a worker thread and talks through an in-memory channel, 
+    so no socket or lock is needed. Each worker wakes up once per tick and 
+    runs all its instances; the log only has the fleet statistics.
+
+    A relay hosts two instances the same way, on the main thread: station 
+    B of the previous hop and station A of the next hop, both over TCP.
+*/
+
+struct INSTANCE {
+    struct PROTOCOL_STATE *ps;
+    int done;
+#ifdef _WIN32
+    LPVOID fiber;
+#else
+    ucontext_t ctx;
+#endif
+};
+
+struct WORKER {
+    struct INSTANCE *inst;
+    int ninst;
+#ifdef _WIN32
+    HANDLE thread;
+    LPVOID sched;
+#else
+    pthread_t thread;
+    ucontext_t sched;
+#endif
+};
+
+extern int main(int argc, char **argv);
+
+static int fleet_argc;
+static char **fleet_argv;
+static struct WORKER *workers;
+static THREAD_LOCAL struct WORKER *worker;     /* of this thread */
+
+static int cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO si;
+
+    GetSystemInfo(&si);
+    return (int)si.dwNumberOfProcessors;
+#else
+    int n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? n : 1;
+#endif
+}
+
+static struct PROTOCOL_STATE *state_new(int station)
+{
+    static int warned, nstate;
+    struct PROTOCOL_STATE *p = mode_canary ? NULL : guard_alloc();
+
+    if (p == NULL) {
+        if (!mode_canary && !warned) {
+            lprintf("WARNING: Failed to allocate guard pages, some instances go without\n");
+            warned = 1;
+        }
+        p = (struct PROTOCOL_STATE *)calloc(1, sizeof(struct PROTOCOL_STATE));
+        if (p == NULL)
+            ABORT("No enough memory");
+    }
+
+    state_defaults(p);
+    p->station = station;
+    p->rand_seed = (mode_seed ^ (station == 'a' ? 97209 : 18231)) + nstate++ * 0x9e3779b9;
+    return p;
+}
+
+static struct PROTOCOL_STATE *instance_new(int station)
+{
+    ps = state_new(station);
+    channel_init();
+    sq_init();
+    return ps;
+}
+
+/* the datalink program, as if it was started with the command line of the fleet */
+#ifdef _WIN32
+static VOID CALLBACK instance_main(LPVOID param)
+#else
+static void instance_main(void)
+#endif
+{
+    main(fleet_argc, fleet_argv);
+    fleet_quit();
+}
+
+static void fleet_yield(void)
+{
+#ifdef _WIN32
+    SwitchToFiber(worker->sched);
+#else
+    swapcontext(&cur_inst->ctx, &worker->sched);
+#endif
+}
+
+/* the instance has lived out 'mode_life', the worker skips it from now on */
+static void fleet_quit(void)
+{
+    cur_inst->done = 1;
+    for (;;)
+        fleet_yield();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_main(LPVOID param)
+#else
+static void *worker_main(void *param)
+#endif
+{
+    struct INSTANCE *volatile in;   /* live across swapcontext() */
+    int i, live, ms0, t;
+
+    worker = (struct WORKER *)param;
+    if (fleet_pairs)
+        lprintf_quiet(1);
+
+#ifdef _WIN32
+    worker->sched = ConvertThreadToFiber(NULL);
+#endif
+    for (i = 0; i < worker->ninst; i++) {
+        in = &worker->inst[i];
+#ifdef _WIN32
+        in->fiber = CreateFiber(FLEET_STACK, instance_main, NULL);
+        if (in->fiber == NULL)
+            ABORT("No enough memory");
+#else
+        getcontext(&in->ctx);
+        in->ctx.uc_stack.ss_sp = malloc(FLEET_STACK);
+        in->ctx.uc_stack.ss_size = FLEET_STACK;
+        in->ctx.uc_link = NULL;
+        if (in->ctx.uc_stack.ss_sp == NULL)
+            ABORT("No enough memory");
+        makecontext(&in->ctx, instance_main, 0);
+#endif
+    }
+
+    do {
+        ms0 = get_ms();
+        for (i = 0, live = 0; i < worker->ninst; i++) {
+            in = &worker->inst[i];
+            if (in->done)
+                continue;
+            ps = in->ps;
+            cur_inst = in;
+#ifdef _WIN32
+            SwitchToFiber(in->fiber);
+#else
+            swapcontext(&worker->sched, &in->ctx);
+#endif
+            live += !in->done;
+        }
+        if (mode_canary)
+            magic_check();
+
+        t = mode_tick - (get_ms() - ms0);
+        if (live && t > 0)
+            Sleep(t);
+    } while (live);
+
+    return 0;
+}
+
+static void fleet_stat(int ms, int ms0, unsigned int *frames0, unsigned int *packets0)
+{
+    struct WORKER *w;
+    unsigned int frames = 0, packets = 0;
+    int i, k;
+
+    for (k = 0; k < fleet_workers; k++) {
+        w = &workers[k];
+        for (i = 0; i < w->ninst; i++) {
+            frames += w->inst[i].ps->rframes;
+            packets += w->inst[i].ps->rpackets;
+        }
+    }
+
+    if (ms > ms0)
+        lprintf(".... %u frames, %u packets received, %.0f frames/s, %.0f packets/s\n", frames, packets, 
+            (double)(frames - *frames0) * 1000 / (ms - ms0), (double)(packets - *packets0) * 1000 / (ms - ms0));
+    *frames0 = frames;
+    *packets0 = packets;
+}
+
+static void fleet_run(int argc, char **argv)
+{
+    struct PROTOCOL_STATE *a, *b;
+    struct WORKER *w;
+    unsigned int frames = 0, packets = 0, frames0 = 0, packets0 = 0;
+    int i, k, ms, stat_ms, ms0;
+
+    if (fleet_workers == 0)
+        fleet_workers = cpu_count();
+    if (fleet_workers > fleet_pairs)
+        fleet_workers = fleet_pairs;
+
+    fleet_argc = argc;
+    fleet_argv = argv;
+    srand(mode_seed);
+    if (mode_canary)
+        magic_init();
+
+    time(&epoch);
+    print_channel("A->B", &chan[CHAN_AB]);
+    print_channel("B->A", &chan[CHAN_BA]);
+    lprintf("%d station pairs, %d workers, memory protection: %s\n", fleet_pairs, fleet_workers, 
+        mode_canary ? "magic words" : "guard pages");
+
+    workers = (struct WORKER *)calloc(fleet_workers, sizeof(struct WORKER));
+    if (workers == NULL)
+        ABORT("No enough memory");
+    for (k = 0; k < fleet_workers; k++) {
+        workers[k].inst = (struct INSTANCE *)calloc((fleet_pairs / fleet_workers + 1) * 2, sizeof(struct INSTANCE));
+        if (workers[k].inst == NULL)
+            ABORT("No enough memory");
+    }
+
+    /* both stations of a pair on the same worker */
+    for (i = 0; i < fleet_pairs; i++) {
+        a = instance_new('a');
+        b = instance_new('b');
+        a->peer = b;
+        b->peer = a;
+        w = &workers[i % fleet_workers];
+        w->inst[w->ninst++].ps = a;
+        w->inst[w->ninst++].ps = b;
+    }
+
+    {
+        struct tm *newtime;
+        newtime = localtime(&epoch);
+        lprintf("New epoch: %s", asctime(newtime));
+        lprintf("=================================================================\n\n");
+    }
+
+    for (k = 0; k < fleet_workers; k++) {
+        w = &workers[k];
+#ifdef _WIN32
+        w->thread = CreateThread(NULL, 0, worker_main, w, 0, NULL);
+        if (w->thread == NULL)
+#else
+        if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+#endif
+            ABORT("Failed to create worker thread");
+    }
+
+    for (ms0 = stat_ms = get_ms(); (ms = get_ms()) <= mode_life; ) {
+        if (ms - stat_ms >= 2000) {
+            fleet_stat(ms, stat_ms, &frames0, &packets0);
+            stat_ms = ms;
+        }
+        Sleep(100);
+    }
+
+    for (k = 0; k < fleet_workers; k++) {
+#ifdef _WIN32
+        WaitForSingleObject(workers[k].thread, INFINITE);
+#else
+        pthread_join(workers[k].thread, NULL);
+#endif
+    }
+
+    lprintf("Fleet totals:\n");
+    fleet_stat(get_ms(), ms0, &frames, &packets);
+    lprintf("Quit.\n");
+    exit(0);
+}
+
+/* 
+    Relay
+
+    The relay is station B of the previous hop and station A of the next 
+    one, each an instance of the datalink program. A packet received on a 
+    hop waits in the queue of the other hop, a full queue drops it. The 
+    end stations skip the packets dropped on the way.
+*/
+
+static void relay_stat(struct PROTOCOL_STATE *p, char *hop)
+{
+    lprintf("%s: %d packets received, %u forwarded on this hop, peak queue %d, avg. wait %.0f ms, %d dropped\n", 
+        hop, p->rpackets, p->rq_out, p->rq_peak, p->rq_out ? p->rq_wait / p->rq_out : 0.0, p->rq_drops);
+}
+
+static void relay_run(int argc, char **argv)
+{
+    struct PROTOCOL_STATE *up, *down;
+    struct CHANNEL mine[2];
+    struct PHASE *my_phases = phases;
+    int my_nphase = nphase, my_chan_assigned = chan_assigned, i;
+    struct WORKER w;
+
+    fleet_argc = argc;
+    fleet_argv = argv;
+    srand(mode_seed);
+    if (mode_canary)
+        magic_init();
+
+    /* the previous hop dictates its channel, the options of the relay are for the next hop */
+    memcpy(mine, chan, sizeof(chan));
+    phases = NULL;
+    nphase = 0;
+    chan_assigned = 0;
+
+    up = ps = state_new('b');
+    station_setup();
+    pkt_sizes = up->sizes;  /* packets travel end to end */
+
+    memcpy(chan, mine, sizeof(chan));
+    phases = my_phases;
+    nphase = my_nphase;
+    chan_assigned = my_chan_assigned;
+
+    down = ps = state_new('a');
+    down->port = relay_port;
+    station_setup();
+
+    up->rq = (struct RELAY_PKT *)malloc(relay_queue * sizeof(struct RELAY_PKT));
+    down->rq = (struct RELAY_PKT *)malloc(relay_queue * sizeof(struct RELAY_PKT));
+    if (up->rq == NULL || down->rq == NULL)
+        ABORT("No enough memory");
+    for (i = 0; i < relay_queue; i++) {
+        up->rq[i].data = (unsigned char *)malloc(pkt_len_max());
+        down->rq[i].data = (unsigned char *)malloc(pkt_len_max());
+        if (up->rq[i].data == NULL || down->rq[i].data == NULL)
+            ABORT("No enough memory");
+    }
+    up->relay = down;
+    down->relay = up;
+    lprintf("Relay between TCP port %u and %u, %d packets queued per hop\n", port, relay_port, relay_queue);
+
+    memset(&w, 0, sizeof(w));
+    w.inst = (struct INSTANCE *)calloc(2, sizeof(struct INSTANCE));
+    if (w.inst == NULL)
+        ABORT("No enough memory");
+    w.inst[w.ninst++].ps = up;
+    w.inst[w.ninst++].ps = down;
+    worker_main(&w);
+
+    relay_stat(up, "Upstream");
+    relay_stat(down, "Downstream");
+    lprintf("Quit.\n");
+    exit(0);
+}
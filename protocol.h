@@ -32,21 +32,48 @@ extern int wait_for_event(int *arg);
 typedef unsigned char seq_nr;
 
 /* Network Layer functions */
-#define PKT_LEN 256
+#define PKT_LEN     256             /* default packet length */
+#define MAX_PKT_LEN (64 * 1024)     /* jumbo packets, see --pkt-size */
+#define FRAME_SLACK 64              /* frame bytes beyond the packet: header, checksum */
+
+/* the longest packet of the session, known after protocol_init(); frames are up to FRAME_SLACK bytes longer */
+extern int  pkt_len_max(void);
 
 extern void enable_network_layer(void);
 extern void disable_network_layer(void);
 extern int  get_packet(unsigned char *packet);
+/* up to 'max' packets, the credit of NETWORK_LAYER_READY (in *arg), return the number fetched */
+extern int  get_packets(unsigned char *bufs[], int lens[], int max);
 extern void put_packet(unsigned char *packet, int len);
+/* a run of in-order packets in one call */
+extern void put_packets(unsigned char *bufs[], int lens[], int n);
 
 /* Physical Layer functions */
+#define PHL_DROPPED     (-1)    /* sending queue is full, frame discarded */
+#define PHL_OK           0
+#define PHL_WOULD_BLOCK  1      /* frame queued, hold the next one until PHYSICAL_LAYER_READY */
+
 extern int  recv_frame(unsigned char *buf, int size);
-extern void send_frame(unsigned char *frame, int len);
+extern int  send_frame(unsigned char *frame, int len);
+
+/* 
+    The physical layer adds the CRC-32 as it encodes the frame, and checks 
+    it as it decodes. recv_frame_crc() returns the frame without the CRC, 
+    or -1 if the CRC is bad.
+*/
+extern int  send_frame_crc(unsigned char *frame, int len);
+extern int  recv_frame_crc(unsigned char *buf, int size);
+/* the same for a retransmission, the receiver keeps the latency of its packet apart */
+extern int  resend_frame_crc(unsigned char *frame, int len);
 
 extern int  phl_sq_len(void);
 
 /* CRC-32 polynomium coding function */
 extern unsigned int crc32(unsigned char *buf, int len);
+extern unsigned int crc32_init(void);
+extern unsigned int crc32_update(unsigned int crc, unsigned char *buf, int len);
+extern unsigned int crc32_final(unsigned int crc);
+extern void crc32_setup(void);  /* tables of crc32(), called by protocol_init() */
 
 /* Timer Management functions */
 extern unsigned int get_ms(void);
@@ -62,6 +89,12 @@ extern void dbg_event(char *fmt, ...);
 extern void dbg_frame(char *fmt, ...);
 extern void dbg_warning(char *fmt, ...);
 
+/* events of the datalink program, summed up by --bulk */
+#define COUNT_NAK       0   /* NAK sent */
+#define COUNT_BAD_CRC   1   /* frame received with a bad checksum */
+#define NCOUNT          2
+extern void dbg_count(int what);
+
 #define MARK lprintf("File \"%s\" (%d)\n", __FILE__, __LINE__)
 
 #ifdef  __cplusplus